@@ -0,0 +1,70 @@
+//
+// Walker/Vose alias table: O(1) sampling of a discrete distribution.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+class AliasTable
+{
+public:
+    AliasTable() = default;
+
+    // weights must be non-negative, entries with weight 0 are never drawn
+    explicit AliasTable(const std::vector<float>& weights)
+    {
+        int n = (int)weights.size();
+        total = 0;
+        for (float w : weights) total += w;
+        if (n == 0 || total <= 0) return;
+
+        bins.resize(n);
+        std::vector<double> scaled(n);
+        std::vector<int> small, large;
+        for (int i = 0; i < n; ++i) {
+            bins[i].pmf = (float)(weights[i] / total);
+            scaled[i] = weights[i] / total * n;
+            (scaled[i] < 1 ? small : large).push_back(i);
+        }
+
+        // every bin gets filled up to 1 by exactly one large entry
+        while (!small.empty() && !large.empty()) {
+            int s = small.back(); small.pop_back();
+            int l = large.back(); large.pop_back();
+            bins[s].q = (float)scaled[s];
+            bins[s].alias = l;
+            scaled[l] -= 1 - scaled[s];
+            (scaled[l] < 1 ? small : large).push_back(l);
+        }
+        // whatever is left is 1 up to rounding
+        for (int i : small) bins[i] = Bin{ 1.f, i, bins[i].pmf };
+        for (int i : large) bins[i] = Bin{ 1.f, i, bins[i].pmf };
+    }
+
+    // index i with probability Pmf(i), u uniform in [0, 1)
+    int Sample(float u) const
+    {
+        int n = (int)bins.size();
+        float scaled = u * n;
+        int ix = std::min((int)scaled, n - 1);
+        return scaled - ix < bins[ix].q ? ix : bins[ix].alias;
+    }
+
+    float Pmf(int ix) const { return bins[ix].pmf; }
+    // sum of the weights the table was built from
+    double Total() const { return total; }
+    bool empty() const { return bins.empty(); }
+    int size() const { return (int)bins.size(); }
+
+private:
+    struct Bin
+    {
+        float q = 1;
+        int alias = 0;
+        float pmf = 0;
+    };
+    std::vector<Bin> bins;
+    double total = 0;
+};
@@ -1,176 +1,463 @@
 #pragma execution_character_set("gbk") 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <future>
+#include <limits>
+#include <thread>
 #include "BVH.hpp"
+#include "Profiler.hpp"
+#include "TriangleBuffer.hpp"
+
+// primitive data cached for the SAH builder, struct-of-arrays indexed by primitive
+struct BVHPrimitiveInfo {
+    std::vector<Bounds3> bounds;
+    std::vector<Vector3f> centroids;
+    std::vector<float> areas;
+};
+
+// ranges larger than this build their left subtree on another thread, in the top levels only
+static const int kParallelBuildThreshold = 4096;
+static const int kMaxBuckets = 64;
+// cost of one node visit relative to one primitive test, used to weigh a split against a leaf.
+// the scalar box test costs about as much as the double precision triangle test
+static const float kTraversalCost = 1.0f;
+
+// counts one query's work and adds it to the thread's TraversalStats (RT_TRAVERSAL_STATS) and
+// profile counters (RT_PROFILE) when the query returns. without either it is empty and the calls vanish
+struct QueryCounter {
+#if defined(RT_TRAVERSAL_STATS) || defined(RT_PROFILE)
+    uint64_t nodes = 0, primitives = 0;
+    void Node() { ++nodes; }
+    void Primitives(int count) { primitives += count; }
+    ~QueryCounter()
+    {
+#ifdef RT_TRAVERSAL_STATS
+        TraversalStats& stats = ThreadTraversalStats();
+        stats.nodesVisited += nodes;
+        stats.primitivesTested += primitives;
+#endif
+        RT_PROFILE_COUNT(BVHQueries, 1);
+        RT_PROFILE_COUNT(BVHNodes, nodes);
+        RT_PROFILE_COUNT(BVHPrimitives, primitives);
+    }
+#else
+    void Node() {}
+    void Primitives(int) {}
+#endif
+};
+
+static float axisOf(const Vector3f& v, int axis)
+{
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
 
 BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
-                   SplitMethod splitMethod, int bucketSize)
-    : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod), bucketSize(bucketSize),
+                   SplitMethod splitMethod, int bucketSize, Layout layout)
+    : maxPrimsInNode(std::max(1, std::min(255, maxPrimsInNode))), splitMethod(splitMethod), layout(layout), bucketSize(bucketSize),
       primitives(std::move(p))
 {
-    time_t start, stop;
-    time(&start);
-    if (primitives.empty())
+    build();
+}
+
+BVHAccel::BVHAccel(TriangleBuffer* triangles, int maxPrimsInNode, int bucketSize, Layout layout)
+    : maxPrimsInNode(std::max(1, std::min(255, maxPrimsInNode))), splitMethod(SplitMethod::SAH), layout(layout),
+      triangles(triangles), bucketSize(bucketSize)
+{
+    build();
+}
+
+BVHAccel::BVHAccel(TriangleBuffer* triangles, std::vector<LinearBVHNode> nodes, std::vector<float> nodeAreas,
+                   int maxPrimsInNode, int bucketSize, Layout layout)
+    : maxPrimsInNode(std::max(1, std::min(255, maxPrimsInNode))), splitMethod(SplitMethod::SAH), layout(layout),
+      triangles(triangles), bucketSize(bucketSize), nodes(std::move(nodes)), nodeAreas(std::move(nodeAreas))
+{
+    collapseWide();
+    buildCost = SAHCost();
+}
+
+void BVHAccel::build()
+{
+    auto start = std::chrono::steady_clock::now();
+    nodes.clear();
+    nodeAreas.clear();
+    int count = triangles ? triangles->size() : (int)primitives.size();
+    if (count == 0) {
+        collapseWide();
         return;
+    }
 
     if (splitMethod == SplitMethod::SAH) {
-        root = recursiveBuildSAH(primitives);
+        // query every primitive once, the builder only works on these arrays and an index list
+        BVHPrimitiveInfo info;
+        info.bounds.resize(count);
+        info.centroids.resize(count);
+        info.areas.resize(count);
+        std::vector<int> indices(count);
+        for (int i = 0; i < count; ++i) {
+            info.bounds[i] = primitiveBounds(i);
+            info.centroids[i] = info.bounds[i].Centroid();
+            info.areas[i] = primitiveArea(i);
+            indices[i] = i;
+        }
+        // about one subtree per core: the first levels fork until there are as many threads
+        // as cores, the rest of the tree is built on the thread that reaches it
+        int parallelLevels = 0;
+        while ((1u << parallelLevels) < std::thread::hardware_concurrency()) ++parallelLevels;
+        root = recursiveBuildSAH(info, indices, 0, count, parallelLevels);
+
+        // leaves cover ranges of indices, which now lists the primitives in leaf order
+        if (triangles) {
+            triangles->Reorder(indices);
+        }
+        else {
+            std::vector<Object*> orderedPrims(count);
+            for (int i = 0; i < count; ++i) orderedPrims[i] = primitives[indices[i]];
+            primitives.swap(orderedPrims);
+        }
     }
     else {
-        root = recursiveBuild(primitives);
+        std::vector<Object*> orderedPrims;
+        root = recursiveBuild(primitives, orderedPrims);
+        primitives.swap(orderedPrims);
     }
 
-    time(&stop);
-    double diff = difftime(stop, start);
-    int hrs = (int)diff / 3600;
-    int mins = ((int)diff / 60) - (hrs * 60);
-    int secs = (int)diff - (hrs * 3600) - (mins * 60);
+    // flatten into a depth-first array
+    int offset = 0;
+    flattenBVHTree(root, &offset);
+    freeBVHTree(root);
+    root = nullptr;
+    collapseWide();
+    buildCost = SAHCost();
+
+    buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("\rBVH Generation complete: %d primitives, %d nodes\nTime Taken: %.1f ms\n\n",
+           count, (int)nodes.size(), buildMs);
+}
 
-    printf(
-        "\rBVH Generation complete: \nTime Taken: %i hrs, %i mins, %i secs\n\n",
-        hrs, mins, secs);
+BVHStats BVHAccel::Stats() const
+{
+    BVHStats stats;
+    stats.primitives = triangles ? triangles->size() : (int)primitives.size();
+    stats.sahCost = SAHCost();
+    stats.buildMs = buildMs;
+    // depth of every node, a child's is one more than its parent's
+    std::vector<int> depth(nodes.size(), 1);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        stats.maxDepth = std::max(stats.maxDepth, depth[i]);
+        if (nodes[i].nPrimitives > 0) {
+            ++stats.leafNodes;
+            continue;
+        }
+        ++stats.interiorNodes;
+        depth[i + 1] = depth[nodes[i].secondChildOffset] = depth[i] + 1;
+    }
+    return stats;
 }
 
-BVHBuildNode* BVHAccel::recursiveBuildSAH(std::vector<Object*> objects) {
-    BVHBuildNode* node = new BVHBuildNode();
-    
-    if (objects.size() == 1) {
-        node->bounds = objects[0]->getBounds();
-        node->object = objects[0];
-        node->left = nullptr;
-        node->right = nullptr;
-        node->area = objects[0]->getArea();
-        return node;
+BVHAccel::~BVHAccel()
+{
+    freeBVHTree(root);
+}
+
+Bounds3 BVHAccel::primitiveBounds(int ix) const
+{
+    return triangles ? triangles->getBounds(ix) : primitives[ix]->getBounds();
+}
+
+float BVHAccel::primitiveArea(int ix) const
+{
+    return triangles ? triangles->getArea(ix) : primitives[ix]->getArea();
+}
+
+void BVHAccel::Refit()
+{
+    // children follow their parent in the depth-first array, so a backward sweep meets them first
+    for (int i = (int)nodes.size() - 1; i >= 0; --i) {
+        LinearBVHNode& node = nodes[i];
+        if (node.nPrimitives > 0) {
+            Bounds3 bounds;
+            float area = 0;
+            for (int k = node.primitivesOffset; k < node.primitivesOffset + node.nPrimitives; ++k) {
+                bounds = Union(bounds, primitiveBounds(k));
+                area += primitiveArea(k);
+            }
+            node.bounds = bounds;
+            nodeAreas[i] = area;
+        }
+        else {
+            node.bounds = Union(nodes[i + 1].bounds, nodes[node.secondChildOffset].bounds);
+            nodeAreas[i] = nodeAreas[i + 1] + nodeAreas[node.secondChildOffset];
+        }
     }
-    else if (objects.size() == 2) {
-        node->left = recursiveBuildSAH(std::vector<Object *>{objects[0]});
-        node->right = recursiveBuildSAH(std::vector<Object*>{objects[1]});
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
-        return node;
+    collapseWide();
+}
+
+float BVHAccel::SAHCost() const
+{
+    if (nodes.empty())
+        return 0;
+    double rootArea = nodes[0].bounds.SurfaceArea();
+    if (rootArea <= 0)
+        return 0;
+    // expected primitive tests and node visits of a ray through the root, by the area ratios
+    double cost = 0;
+    for (const LinearBVHNode& node : nodes) {
+        double visit = node.bounds.SurfaceArea() / rootArea;
+        cost += visit * (node.nPrimitives > 0 ? node.nPrimitives : kTraversalCost);
     }
+    return (float)cost;
+}
+
+bool BVHAccel::Update(float maxCostGrowth)
+{
+    Refit();
+    if (SAHCost() <= buildCost * maxCostGrowth)
+        return false;
+    // the primitives are still all there, in leaf order, so they are simply built again
+    build();
+    return true;
+}
+
+void BVHAccel::collapseWide()
+{
+    wideNodes4.clear();
+    wideNodes8.clear();
+    if (nodes.empty())
+        return;
+    if (layout == Layout::WIDE4) {
+        collapseBVHTree(0, wideNodes4);
+    }
+    else if (layout == Layout::WIDE8) {
+        collapseBVHTree(0, wideNodes8);
+    }
+}
 
-    std::vector<Object*> splitLeftObjects;
-    std::vector<Object*> splitRightObjects;
-    float minCost = std::numeric_limits<float>::max();
-    float boundLength, bucketLength, objectLength, bucketIndex;
+Bounds3 BVHAccel::WorldBound() const
+{
+    return nodes.empty() ? Bounds3() : nodes[0].bounds;
+}
 
-    Bounds3 nodeBound;
+int BVHAccel::flattenBVHTree(BVHBuildNode* node, int* offset)
+{
+    int nodeOffset = (*offset)++;
+    nodes.emplace_back();
+    nodeAreas.push_back(node->area);
 
-    for (int i = 0; i < objects.size(); i++) {
-        nodeBound = Union(nodeBound, objects[i]->getBounds());
+    LinearBVHNode& linearNode = nodes[nodeOffset];
+    linearNode.bounds = node->bounds;
+    if (node->left == nullptr && node->right == nullptr) {
+        linearNode.primitivesOffset = node->firstPrimOffset;
+        linearNode.nPrimitives = (uint16_t)node->nPrimitives;
+        linearNode.axis = 0;
+    }
+    else {
+        linearNode.axis = (uint8_t)node->splitAxis;
+        linearNode.nPrimitives = 0;
+        flattenBVHTree(node->left, offset);
+        // nodes may have grown, don't keep the reference across the recursion
+        int secondChildOffset = flattenBVHTree(node->right, offset);
+        nodes[nodeOffset].secondChildOffset = secondChildOffset;
     }
+    return nodeOffset;
+}
 
-    // 0->x axis; 1->y axis; 2->z axis. 
-    for (int axis = 0; axis < 3; axis++) {
-        // vector<>(count, initialValue);
-        // ͰӼ, ÿͰӷεObject
-        std::vector<std::vector<Object *>>* buckets = new std::vector<std::vector<Object*>>(bucketSize, std::vector<Object *>());
-        // ӦͰӵBounds
-        std::vector<Bounds3>* bucketBounds = new std::vector<Bounds3>(bucketSize, Bounds3());
-        std::vector<Object*>* leftObjects = new std::vector<Object*>();
-        std::vector<Object*>* rightObjects = new std::vector<Object*>();
+template <int N>
+int BVHAccel::collapseBVHTree(int nodeIx, std::vector<WideBVHNode<N>>& wide)
+{
+    auto isLeaf = [&](int n) { return nodes[n].nPrimitives > 0; };
 
-        switch (axis)
-        {
-        case 0:
-            boundLength = nodeBound.pMax.x - nodeBound.pMin.x;
-            bucketLength = boundLength / bucketSize;
-            // 
-            for (auto object : objects) {
-                objectLength = object->getBounds().Centroid().x - nodeBound.pMin.x;
-                bucketIndex = clamp(0, bucketSize-1, floor((objectLength / bucketLength)));
-
-                // Ͱ
-                (*buckets)[bucketIndex].emplace_back(object);
-                (*bucketBounds)[bucketIndex] = Union((*bucketBounds)[bucketIndex], object->getBounds());
-            }
-            break;
-        case 1:
-            boundLength = nodeBound.pMax.y - nodeBound.pMin.y;
-            bucketLength = boundLength / bucketSize;
-            for (auto object : objects) {
-                objectLength = object->getBounds().Centroid().y - nodeBound.pMin.y;
-                bucketIndex = clamp(0, bucketSize-1, floor((objectLength / bucketLength)));
-
-                (*buckets)[bucketIndex].emplace_back(object);
-                (*bucketBounds)[bucketIndex] = Union((*bucketBounds)[bucketIndex], object->getBounds());
-            }
-            break;
-        case 2:
-            boundLength = nodeBound.pMax.z - nodeBound.pMin.z;
-            bucketLength = boundLength / bucketSize;
-            for (auto object : objects) {
-                // ﷢˸㾫µĴ, Χļ俿ΧбԵ
-                // ׵buckets, ĵģ, Χy߶ȼΪ0
-                // ע: clampܻһĴ
-                objectLength = object->getBounds().Centroid().z - nodeBound.pMin.z;
-                bucketIndex = clamp(0, bucketSize-1, floor((objectLength / bucketLength)));
-
-                (*buckets)[bucketIndex].emplace_back(object);
-                (*bucketBounds)[bucketIndex] = Union((*bucketBounds)[bucketIndex], object->getBounds());
+    // pull grandchildren up until the node is full, always opening the largest inner child
+    int children[N];
+    int childCount = 0;
+    if (isLeaf(nodeIx)) {
+        children[childCount++] = nodeIx;
+    }
+    else {
+        children[childCount++] = nodeIx + 1;
+        children[childCount++] = nodes[nodeIx].secondChildOffset;
+    }
+    while (childCount < N) {
+        int best = -1;
+        double bestArea = -1;
+        for (int i = 0; i < childCount; ++i) {
+            if (!isLeaf(children[i]) && nodes[children[i]].bounds.SurfaceArea() > bestArea) {
+                best = i;
+                bestArea = nodes[children[i]].bounds.SurfaceArea();
             }
-            break;
         }
+        if (best == -1) break;
+        int opened = children[best];
+        children[best] = opened + 1;
+        children[childCount++] = nodes[opened].secondChildOffset;
+    }
 
-        int betterSplitIndex = -1;
-        // bucketSize-1ַָĻ
-        for (int splitIndex = 1; splitIndex < bucketSize; splitIndex++) {
+    int wideIx = (int)wide.size();
+    wide.emplace_back();
+    {
+        WideBVHNode<N>& wideNode = wide[wideIx];
+        wideNode.childCount = childCount;
+        for (int i = 0; i < N; ++i) {
+            // unused slots are masked out by childCount, keep their data finite anyway
+            const Bounds3& b = i < childCount ? nodes[children[i]].bounds : nodes[nodeIx].bounds;
+            wideNode.minX[i] = b.pMin.x; wideNode.minY[i] = b.pMin.y; wideNode.minZ[i] = b.pMin.z;
+            wideNode.maxX[i] = b.pMax.x; wideNode.maxY[i] = b.pMax.y; wideNode.maxZ[i] = b.pMax.z;
+            wideNode.child[i] = -1;
+            wideNode.nPrimitives[i] = 0;
+        }
+    }
+    for (int i = 0; i < childCount; ++i) {
+        if (isLeaf(children[i])) {
+            wide[wideIx].child[i] = nodes[children[i]].primitivesOffset;
+            wide[wideIx].nPrimitives[i] = nodes[children[i]].nPrimitives;
+        }
+        else {
+            // wide may grow, index it again after the recursion
+            int childIx = collapseBVHTree(children[i], wide);
+            wide[wideIx].child[i] = childIx;
+        }
+    }
+    return wideIx;
+}
 
-            Bounds3 leftBound, rightBound;
-            int countLeft = 0, countRight = 0;
+void BVHAccel::freeBVHTree(BVHBuildNode* node)
+{
+    if (node == nullptr) return;
+    freeBVHTree(node->left);
+    freeBVHTree(node->right);
+    delete node;
+}
 
-            // ϲΧ
-            for (int i = 0; i < splitIndex; i++) {
-                leftBound = Union(leftBound, (*bucketBounds)[i]);
-                countLeft += (*buckets)[i].size();
-            }
-            // ϲҰΧ
-            for (int j = splitIndex; j < bucketSize; j++) {
-                rightBound = Union(rightBound, (*bucketBounds)[j]);
-                countRight += (*buckets)[j].size();
-            }
+BVHBuildNode* BVHAccel::recursiveBuildSAH(BVHPrimitiveInfo& info, std::vector<int>& indices, int start, int end,
+                                          int parallelLevels) {
+    BVHBuildNode* node = new BVHBuildNode();
+    int count = end - start;
+
+    // leaf over indices[start, end), the range stays in place so it is already in leaf order
+    auto makeLeaf = [&]() {
+        node->firstPrimOffset = start;
+        node->nPrimitives = count;
+        node->area = 0;
+        for (int i = start; i < end; ++i) {
+            node->bounds = Union(node->bounds, info.bounds[indices[i]]);
+            node->area += info.areas[indices[i]];
+        }
+        return node;
+    };
 
-            // SAHʽ
-            float cost = leftBound.SurfaceArea() / nodeBound.SurfaceArea() * countLeft +
-                rightBound.SurfaceArea() / nodeBound.SurfaceArea() * countRight;
+    if (count == 1) {
+        return makeLeaf();
+    }
 
-            if (cost < minCost) {
-                minCost = cost;
-                betterSplitIndex = splitIndex;
-            }
-        }
+    Bounds3 bounds, centroidBounds;
+    for (int i = start; i < end; ++i) {
+        bounds = Union(bounds, info.bounds[indices[i]]);
+        centroidBounds = Union(centroidBounds, info.centroids[indices[i]]);
+    }
 
-        if (betterSplitIndex != -1) {
-            for (int i = 0; i < betterSplitIndex; i++) {
-                leftObjects->insert(leftObjects->end(), (*buckets)[i].begin(), (*buckets)[i].end());
+    int* first = indices.data() + start;
+    int* last = indices.data() + end;
+    int* pmid = nullptr;
+    int bestAxis = centroidBounds.maxExtent();
+
+    if (count > 2) {
+        // Ͱ, ÿͰ¼Χк
+        int nBuckets = std::max(2, std::min(bucketSize, kMaxBuckets));
+        float minCost = std::numeric_limits<float>::max();
+        int bestSplit = -1;
+
+        // 0->x axis; 1->y axis; 2->z axis.
+        for (int axis = 0; axis < 3; axis++) {
+            float axisMin = axisOf(centroidBounds.pMin, axis);
+            float axisExtent = axisOf(centroidBounds.pMax, axis) - axisMin;
+            if (axisExtent <= 0) continue;
+
+            Bounds3 bucketBounds[kMaxBuckets];
+            int bucketCounts[kMaxBuckets] = {};
+            for (int* it = first; it != last; ++it) {
+                int b = (int)(nBuckets * ((axisOf(info.centroids[*it], axis) - axisMin) / axisExtent));
+                b = std::min(b, nBuckets - 1);
+                bucketCounts[b]++;
+                bucketBounds[b] = Union(bucketBounds[b], info.bounds[*it]);
             }
 
-            for (int j = betterSplitIndex; j < bucketSize; j++) {
-                rightObjects->insert(rightObjects->end(), (*buckets)[j].begin(), (*buckets)[j].end());
+            // SAHʽ, ǰ׺/׺ɨһ, ָͰ i  i+1 ֮
+            float leftCost[kMaxBuckets];
+            Bounds3 sweepBounds;
+            int sweepCount = 0;
+            for (int i = 0; i < nBuckets - 1; ++i) {
+                sweepBounds = Union(sweepBounds, bucketBounds[i]);
+                sweepCount += bucketCounts[i];
+                leftCost[i] = sweepCount > 0 ? sweepCount * (float)sweepBounds.SurfaceArea() : 0;
             }
+            sweepBounds = Bounds3();
+            sweepCount = 0;
+            for (int i = nBuckets - 1; i > 0; --i) {
+                sweepBounds = Union(sweepBounds, bucketBounds[i]);
+                sweepCount += bucketCounts[i];
+                float cost = leftCost[i - 1] + (sweepCount > 0 ? sweepCount * (float)sweepBounds.SurfaceArea() : 0);
+                if (cost < minCost) {
+                    minCost = cost;
+                    bestAxis = axis;
+                    bestSplit = i - 1;
+                }
+            }
+        }
 
-            assert(objects.size() == (leftObjects->size() + rightObjects->size()));
-
-            splitLeftObjects = *leftObjects;
-            splitRightObjects = *rightObjects;
+        if (bestSplit != -1) {
+            float axisMin = axisOf(centroidBounds.pMin, bestAxis);
+            float axisExtent = axisOf(centroidBounds.pMax, bestAxis) - axisMin;
+            pmid = std::partition(first, last, [&](int primIx) {
+                int b = (int)(nBuckets * ((axisOf(info.centroids[primIx], bestAxis) - axisMin) / axisExtent));
+                return std::min(b, nBuckets - 1) <= bestSplit;
+            });
         }
+    }
 
-        delete buckets;
-        delete bucketBounds;
-        delete leftObjects;
-        delete rightObjects;
+    // two primitives, or all centroids in one bucket: split the range in half along the widest axis
+    if (pmid == nullptr || pmid == first || pmid == last) {
+        pmid = first + count / 2;
+        std::nth_element(first, pmid, last, [&](int a, int b) {
+            return axisOf(info.centroids[a], bestAxis) < axisOf(info.centroids[b], bestAxis);
+        });
+    }
+    int mid = (int)(pmid - indices.data());
+
+    // few enough primitives for a leaf: keep them together unless the split is cheaper.
+    // costs are in primitive tests, a child is entered with probability area(child) / area(node)
+    if (count <= maxPrimsInNode) {
+        float nodeArea = (float)bounds.SurfaceArea();
+        if (nodeArea <= 0) {
+            return makeLeaf();
+        }
+        Bounds3 leftBounds, rightBounds;
+        for (int i = start; i < mid; ++i) leftBounds = Union(leftBounds, info.bounds[indices[i]]);
+        for (int i = mid; i < end; ++i) rightBounds = Union(rightBounds, info.bounds[indices[i]]);
+        float splitCost = kTraversalCost + ((mid - start) * (float)leftBounds.SurfaceArea()
+                                            + (end - mid) * (float)rightBounds.SurfaceArea()) / nodeArea;
+        if ((float)count <= splitCost) {
+            return makeLeaf();
+        }
     }
+    node->splitAxis = bestAxis;
 
-    node->left = recursiveBuildSAH(splitLeftObjects);
-    node->right = recursiveBuildSAH(splitRightObjects);
+    if (parallelLevels > 0 && count > kParallelBuildThreshold) {
+        auto left = std::async(std::launch::async,
+                               [&] { return recursiveBuildSAH(info, indices, start, mid, parallelLevels - 1); });
+        node->right = recursiveBuildSAH(info, indices, mid, end, parallelLevels - 1);
+        node->left = left.get();
+    }
+    else {
+        node->left = recursiveBuildSAH(info, indices, start, mid, 0);
+        node->right = recursiveBuildSAH(info, indices, mid, end, 0);
+    }
     node->bounds = Union(node->left->bounds, node->right->bounds);
     node->area = node->left->area + node->right->area;
 
     return node;
 }
 
-BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
+BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects, std::vector<Object*>& orderedPrims)
 {
     BVHBuildNode* node = new BVHBuildNode();
 
@@ -178,19 +465,24 @@ BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
     Bounds3 bounds;
     for (int i = 0; i < objects.size(); ++i)
         bounds = Union(bounds, objects[i]->getBounds());
-    if (objects.size() == 1) {
-        // Create leaf _BVHBuildNode_
-        node->bounds = objects[0]->getBounds();
-        node->object = objects[0];
+    if (objects.size() <= (size_t)maxPrimsInNode) {
+        // Create leaf _BVHBuildNode_, its objects are appended in depth-first order
+        node->bounds = bounds;
+        node->firstPrimOffset = (int)orderedPrims.size();
+        node->nPrimitives = (int)objects.size();
         node->left = nullptr;
         node->right = nullptr;
         // 
-        node->area = objects[0]->getArea();
+        node->area = 0;
+        for (Object* object : objects) {
+            orderedPrims.push_back(object);
+            node->area += object->getArea();
+        }
         return node;
     }
     else if (objects.size() == 2) {
-        node->left = recursiveBuild(std::vector{objects[0]});
-        node->right = recursiveBuild(std::vector{objects[1]});
+        node->left = recursiveBuild(std::vector{objects[0]}, orderedPrims);
+        node->right = recursiveBuild(std::vector{objects[1]}, orderedPrims);
 
         node->bounds = Union(node->left->bounds, node->right->bounds);
         node->area = node->left->area + node->right->area;
@@ -202,6 +494,7 @@ BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
             centroidBounds =
                 Union(centroidBounds, objects[i]->getBounds().Centroid());
         int dim = centroidBounds.maxExtent();
+        node->splitAxis = dim;
         switch (dim) {
         case 0:
             std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
@@ -232,8 +525,8 @@ BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
 
         assert(objects.size() == (leftshapes.size() + rightshapes.size()));
 
-        node->left = recursiveBuild(leftshapes);
-        node->right = recursiveBuild(rightshapes);
+        node->left = recursiveBuild(leftshapes, orderedPrims);
+        node->right = recursiveBuild(rightshapes, orderedPrims);
 
         node->bounds = Union(node->left->bounds, node->right->bounds);
         node->area = node->left->area + node->right->area;
@@ -242,66 +535,324 @@ BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
     return node;
 }
 
+// triangle buffer leaves are tested in place, object leaves go through the virtual interface
+void BVHAccel::intersectLeaf(int offset, int count, const Ray& ray, Intersection& isect) const
+{
+    if (triangles) {
+        for (int i = 0; i < count; ++i) {
+            triangles->intersect(offset + i, ray, isect);
+        }
+        return;
+    }
+    for (int i = 0; i < count; ++i) {
+        Intersection inter = primitives[offset + i]->getIntersection(ray);
+        if (inter.happened && inter.distance < isect.distance) {
+            isect = inter;
+        }
+    }
+}
+
+bool BVHAccel::intersectLeafP(int offset, int count, const Ray& ray) const
+{
+    for (int i = 0; i < count; ++i) {
+        if (triangles ? triangles->intersectP(offset + i, ray) : primitives[offset + i]->intersect(ray)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 Intersection BVHAccel::Intersect(const Ray& ray) const
 {
+    if (layout == Layout::WIDE4)
+        return IntersectWide(wideNodes4, ray);
+    if (layout == Layout::WIDE8)
+        return IntersectWide(wideNodes8, ray);
+
     Intersection isect;
-    if (!root)
+    if (nodes.empty())
         return isect;
-    isect = BVHAccel::getIntersection(root, ray);
+
+    int dirIsNeg[3] = { ray.direction_inv.x < 0, ray.direction_inv.y < 0, ray.direction_inv.z < 0 };
+
+    // nodes still to be visited, near child first
+    QueryCounter counter;
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    int nodesToVisit[64];
+    while (true) {
+        const LinearBVHNode* node = &nodes[currentNodeIndex];
+        counter.Node();
+        // boxes entered behind the closest hit so far can't hold a closer one
+        if (node->bounds.IntersectP(ray, ray.direction_inv, dirIsNeg, isect.distanceBound())) {
+            if (node->nPrimitives > 0) {
+                counter.Primitives(node->nPrimitives);
+                intersectLeaf(node->primitivesOffset, node->nPrimitives, ray, isect);
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            }
+            else {
+                // the child on the side the ray comes from is nearer
+                if (dirIsNeg[node->axis]) {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node->secondChildOffset;
+                }
+                else {
+                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+            }
+        }
+        else {
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
     return isect;
 }
 
-Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
+bool BVHAccel::IntersectP(const Ray& ray, float tMax) const
+{
+    Ray shadowRay = ray;
+    shadowRay.t_max = tMax;
+    return IntersectP(shadowRay);
+}
+
+bool BVHAccel::IntersectP(const Ray& ray) const
 {
-    // TODO Traverse the BVH to find intersection
-    Intersection inter;
+    if (nodes.empty())
+        return false;
+
+    // any hit will do, so the binary nodes are walked without tracking the closest one
+    int dirIsNeg[3] = { ray.direction_inv.x < 0, ray.direction_inv.y < 0, ray.direction_inv.z < 0 };
+    float tMax = (float)std::min(ray.t_max, (double)std::numeric_limits<float>::max());
+
+    QueryCounter counter;
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    int nodesToVisit[64];
+    while (true) {
+        const LinearBVHNode* node = &nodes[currentNodeIndex];
+        counter.Node();
+        if (node->bounds.IntersectP(ray, ray.direction_inv, dirIsNeg, tMax)) {
+            if (node->nPrimitives > 0) {
+                // counted whole, although the test stops at the first hit
+                counter.Primitives(node->nPrimitives);
+                if (intersectLeafP(node->primitivesOffset, node->nPrimitives, ray)) {
+                    return true;
+                }
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            }
+            else {
+                if (dirIsNeg[node->axis]) {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node->secondChildOffset;
+                }
+                else {
+                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+            }
+        }
+        else {
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+    return false;
+}
 
-    if (!(node->bounds.IntersectP(ray, ray.direction_inv))) return inter;
+// slab test of one ray against all children of a wide node, returns the mask of children
+// entered before tMax and their entry distances
+template <int N>
+static int intersectWideNode(const WideBVHNode<N>& node, const Ray& ray, const int dirIsNeg[3], float tMax, float* tEntry)
+{
+    using vfloat = typename SimdFloat<N>::type;
+
+    vfloat tMin(-std::numeric_limits<float>::infinity());
+    vfloat tOut(std::numeric_limits<float>::infinity());
+    const vfloat robust(1 + 2 * 1.8e-7f);
+
+    // the running value is the second operand: vmin/vmax return it when the new one is NaN,
+    // so like the scalar test a slab the ray starts on with zero direction does not restrict
+    vfloat ox(ray.origin.x), invx(ray.direction_inv.x);
+    tMin = vmax((vfloat::load(dirIsNeg[0] ? node.maxX : node.minX) - ox) * invx, tMin);
+    tOut = vmin((vfloat::load(dirIsNeg[0] ? node.minX : node.maxX) - ox) * invx * robust, tOut);
+    vfloat oy(ray.origin.y), invy(ray.direction_inv.y);
+    tMin = vmax((vfloat::load(dirIsNeg[1] ? node.maxY : node.minY) - oy) * invy, tMin);
+    tOut = vmin((vfloat::load(dirIsNeg[1] ? node.minY : node.maxY) - oy) * invy * robust, tOut);
+    vfloat oz(ray.origin.z), invz(ray.direction_inv.z);
+    tMin = vmax((vfloat::load(dirIsNeg[2] ? node.maxZ : node.minZ) - oz) * invz, tMin);
+    tOut = vmin((vfloat::load(dirIsNeg[2] ? node.minZ : node.maxZ) - oz) * invz * robust, tOut);
+
+    tMin.store(tEntry);
+    auto hit = (tMin <= tOut) & (tOut >= vfloat(0.f)) & (tMin <= vfloat(tMax));
+    return hit.bits() & ((1 << node.childCount) - 1);
+}
 
-    Intersection l_inter;
-    Intersection r_inter;
+template <int N>
+Intersection BVHAccel::IntersectWide(const std::vector<WideBVHNode<N>>& wide, const Ray& ray) const
+{
+    Intersection isect;
+    if (wide.empty())
+        return isect;
 
-    if (node->right != nullptr) {
-        r_inter = getIntersection(node->right, ray);
+    int dirIsNeg[3] = { ray.direction_inv.x < 0, ray.direction_inv.y < 0, ray.direction_inv.z < 0 };
+
+    struct StackEntry { int node; float tEntry; };
+    StackEntry nodesToVisit[64 * N];
+    int toVisitOffset = 0;
+    QueryCounter counter;
+    nodesToVisit[toVisitOffset++] = { 0, -std::numeric_limits<float>::infinity() };
+
+    while (toVisitOffset > 0) {
+        StackEntry entry = nodesToVisit[--toVisitOffset];
+        // a closer hit was found since this node was pushed
+        if (entry.tEntry > isect.distance) continue;
+
+        const WideBVHNode<N>& node = wide[entry.node];
+        counter.Node();
+        alignas(32) float tEntry[N];
+        int hitMask = intersectWideNode(node, ray, dirIsNeg, isect.distanceBound(), tEntry);
+
+        // leaves are tested right away, inner children are pushed far to near
+        StackEntry inner[N];
+        int innerCount = 0;
+        for (int i = 0; i < N; ++i) {
+            if (!(hitMask & (1 << i))) continue;
+            if (node.nPrimitives[i] > 0) {
+                counter.Primitives(node.nPrimitives[i]);
+                intersectLeaf(node.child[i], node.nPrimitives[i], ray, isect);
+            }
+            else {
+                inner[innerCount++] = { node.child[i], tEntry[i] };
+            }
+        }
+        std::sort(inner, inner + innerCount, [](const StackEntry& a, const StackEntry& b) { return a.tEntry > b.tEntry; });
+        for (int i = 0; i < innerCount; ++i) {
+            nodesToVisit[toVisitOffset++] = inner[i];
+        }
     }
+    return isect;
+}
 
-    if (node->left != nullptr) {
-        l_inter = getIntersection(node->left, ray);
-    }
+static void getPacketIntersection(Object* object, const RayPacket4& packet, int mask, Intersection* hits)
+{
+    object->getIntersection4(packet, mask, hits);
+}
 
-    if (node->left == nullptr && node->right == nullptr) {
-        return node->object->getIntersection(ray);
+static void getPacketIntersection(Object* object, const RayPacket8& packet, int mask, Intersection* hits)
+{
+    object->getIntersection8(packet, mask, hits);
+}
+
+template <int N>
+void BVHAccel::intersectLeafPacket(int offset, int count, const RayPacket<N>& packet, int mask, Intersection* hits) const
+{
+    if (triangles) {
+        for (int i = 0; i < count; ++i) {
+            triangles->intersectPacket(offset + i, packet, mask, hits);
+        }
+        return;
+    }
+    for (int i = 0; i < count; ++i) {
+        getPacketIntersection(primitives[offset + i], packet, mask, hits);
     }
+}
 
-    if (r_inter.distance < l_inter.distance) {
-        return r_inter;
+template <int N>
+void BVHAccel::IntersectPacket(const RayPacket<N>& packet, Intersection* hits, int mask) const
+{
+    mask &= packet.activeMask;
+    if (nodes.empty() || mask == 0)
+        return;
+
+    alignas(32) float tMax[N];
+    for (int lane = 0; lane < N; ++lane) {
+        tMax[lane] = hits[lane].distanceBound();
     }
-    else {
-        return l_inter;
+
+    // coherent rays share direction signs, so the first lane decides the near child
+    int lead = firstLane(mask);
+    int dirIsNeg[3] = { packet.invx[lead] < 0, packet.invy[lead] < 0, packet.invz[lead] < 0 };
+
+    // a packet's node test counts once, like one ray's
+    QueryCounter counter;
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    int nodesToVisit[64];
+    while (true) {
+        const LinearBVHNode* node = &nodes[currentNodeIndex];
+        counter.Node();
+        int hitMask = node->bounds.IntersectP(packet, tMax) & mask;
+        if (hitMask) {
+            if (node->nPrimitives > 0) {
+                counter.Primitives(node->nPrimitives);
+                intersectLeafPacket(node->primitivesOffset, node->nPrimitives, packet, hitMask, hits);
+                for (int lane = 0; lane < N; ++lane) {
+                    tMax[lane] = hits[lane].distanceBound();
+                }
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            }
+            else {
+                if (dirIsNeg[node->axis]) {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node->secondChildOffset;
+                }
+                else {
+                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+            }
+        }
+        else {
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
     }
+}
 
-    return inter;
+void BVHAccel::Intersect4(const RayPacket4& packet, Intersection* hits, int mask) const
+{
+    IntersectPacket(packet, hits, mask);
 }
 
-void BVHAccel::getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf){
-    // ӽڵ
-    if(node->left == nullptr || node->right == nullptr){
-        // objectmeshtriangle, Ҳtriangle
-        node->object->Sample(pos, pdf);
-        // pdfʹûнڵ  / ()ʾ
-        pdf *= node->area;
-        return;
+void BVHAccel::Intersect8(const RayPacket8& packet, Intersection* hits, int mask) const
+{
+    IntersectPacket(packet, hits, mask);
+}
+
+void BVHAccel::getSample(int nodeIx, float p, Intersection &pos, float &pdf){
+    while (nodes[nodeIx].nPrimitives == 0) {
+        // ӳpĳӽڵ
+        int leftIx = nodeIx + 1;
+        if (p < nodeAreas[leftIx]) nodeIx = leftIx;
+        else {
+            p -= nodeAreas[leftIx];
+            nodeIx = nodes[nodeIx].secondChildOffset;
+        }
+    }
+    // ӽڵ, ʣµpͬӳ䵽ҶĳԪ
+    const LinearBVHNode& leaf = nodes[nodeIx];
+    int primIx = leaf.primitivesOffset;
+    float primArea = 0;
+    for (int i = 0; i < leaf.nPrimitives; ++i) {
+        primIx = leaf.primitivesOffset + i;
+        primArea = primitiveArea(primIx);
+        if (p < primArea) break;
+        p -= primArea;
     }
-    // ӳpĳӽڵ
-    if(p < node->left->area) getSample(node->left, p, pos, pdf);
-    else getSample(node->right, p - node->left->area, pos, pdf);
+    // objectmeshtriangle, Ҳtriangle
+    if (triangles) triangles->Sample(primIx, pos, pdf);
+    else primitives[primIx]->Sample(pos, pdf);
+    // pdfʹûлԪ  / ()ʾ
+    pdf *= primArea;
 }
 
 // ֱΪʲôbvhҪв, ΪĹԴҲʹõMeshTriangle, ԹԴĲ, ͹й
 void BVHAccel::Sample(Intersection &pos, float &pdf){
     // ȡСڸһֵp
-    float p = std::sqrt(get_random_float()) * root->area;
-    getSample(root, p, pos, pdf);
+    float p = get_random_float() * nodeAreas[0];
+    getSample(0, p, pos, pdf);
     // pdfʹûнڵ  / ()ʾ, ˵ǾȲ
-    pdf /= root->area;
+    pdf /= nodeAreas[0];
 }
\ No newline at end of file
@@ -6,9 +6,9 @@
 #define RAYTRACING_BVH_H
 
 #include <atomic>
+#include <cstdint>
 #include <vector>
 #include <memory>
-#include <ctime>
 #include "Object.hpp"
 #include "Ray.hpp"
 #include "Bounds3.hpp"
@@ -16,38 +16,146 @@
 #include "Vector.hpp"
 
 struct BVHBuildNode;
+class TriangleBuffer;
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
 
+// 32 byte node of the flattened tree, two of them share a cache line
+struct LinearBVHNode {
+    Bounds3 bounds;
+    union {
+        int primitivesOffset;   // leaf
+        int secondChildOffset;  // interior
+    };
+    uint16_t nPrimitives;       // 0 -> interior node
+    uint8_t axis;               // interior node: xyz
+    uint8_t pad[1];             // ensure 32 byte total size
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should be 32 bytes");
+
+// N-wide node, child bounds are stored as struct-of-arrays so one ray is tested
+// against all children with a single SIMD instruction sequence
+template <int N>
+struct WideBVHNode {
+    alignas(32) float minX[N], minY[N], minZ[N];
+    alignas(32) float maxX[N], maxY[N], maxZ[N];
+    int child[N];             // inner child: wide node index; leaf child: primitive offset
+    uint16_t nPrimitives[N];  // 0 -> inner child
+    int childCount;           // children occupy slots [0, childCount)
+};
+
+// shape of a built tree
+struct BVHStats {
+    int primitives = 0;
+    int interiorNodes = 0;
+    int leafNodes = 0;
+    int maxDepth = 0;
+    float sahCost = 0;
+    // wall time of the last build (not refits)
+    double buildMs = 0;
+};
+
+// node visits and primitive tests of the BVH queries run by the calling thread, nested
+// (instanced) trees included. only counted when BVH.cpp is compiled with RT_TRAVERSAL_STATS
+struct TraversalStats {
+    uint64_t nodesVisited = 0;
+    uint64_t primitivesTested = 0;
+};
+
+inline TraversalStats& ThreadTraversalStats()
+{
+    thread_local TraversalStats stats;
+    return stats;
+}
+
 // BVHAccel Declarations
-inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
 class BVHAccel {
 
 public:
     // BVHAccel Public Types
     enum class SplitMethod { NAIVE, SAH };
+    // node layout used by Intersect: the binary tree, or the tree collapsed into 4/8-wide nodes
+    enum class Layout { BINARY, WIDE4, WIDE8 };
 
     // BVHAccel Public Methods
-    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE, int bucketSize = 18);
+    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE, int bucketSize = 18,
+             Layout layout = Layout::BINARY);
+    // tree over the triangles of a buffer, always SAH built. the buffer is reordered so
+    // every leaf covers a contiguous range of it, and must outlive the tree
+    BVHAccel(TriangleBuffer* triangles, int maxPrimsInNode = 1, int bucketSize = 18,
+             Layout layout = Layout::BINARY);
+    // the same tree from the nodes of an earlier build (SceneCache): triangles must already be
+    // in that build's leaf order, nothing is rebuilt
+    BVHAccel(TriangleBuffer* triangles, std::vector<LinearBVHNode> nodes, std::vector<float> nodeAreas,
+             int maxPrimsInNode = 1, int bucketSize = 18, Layout layout = Layout::BINARY);
     Bounds3 WorldBound() const;
+    // recompute every node's bounds bottom-up after primitives moved, keeping the tree topology
+    void Refit();
+    // expected cost of a ray through the tree (node visits and primitive tests by area ratios)
+    float SAHCost() const;
+    // refit, and build again if that left SAHCost above maxCostGrowth times the cost of the last build.
+    // true when it rebuilt
+    bool Update(float maxCostGrowth = 1.5f);
+    BVHStats Stats() const;
     ~BVHAccel();
 
     Intersection Intersect(const Ray &ray) const;
-    Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
+    // closest hits of 4/8 coherent rays, lanes outside mask are left alone
+    void Intersect4(const RayPacket4& packet, Intersection* hits, int mask = 0xff) const;
+    void Intersect8(const RayPacket8& packet, Intersection* hits, int mask = 0xff) const;
+    // occlusion query: true as soon as any primitive is hit within (ray.t_min, ray.t_max)
     bool IntersectP(const Ray &ray) const;
-    BVHBuildNode* root;
+    bool IntersectP(const Ray &ray, float tMax) const;
+    // build tree, released once it has been flattened into nodes
+    BVHBuildNode* root = nullptr;
 
     // BVHAccel Private Methods
-    BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
-    BVHBuildNode* recursiveBuildSAH(std::vector<Object*>objects);
+    void build();
+    // leaves hold up to maxPrimsInNode primitives; NAIVE appends them to orderedPrims,
+    // SAH leaves keep a range of indices, which ends up in leaf order
+    BVHBuildNode* recursiveBuild(std::vector<Object*>objects, std::vector<Object*>& orderedPrims);
+    // the left subtrees of the first parallelLevels levels are built on threads of their own
+    BVHBuildNode* recursiveBuildSAH(BVHPrimitiveInfo& info, std::vector<int>& indices, int start, int end,
+                                    int parallelLevels);
+    int flattenBVHTree(BVHBuildNode* node, int* offset);
+    Bounds3 primitiveBounds(int ix) const;
+    float primitiveArea(int ix) const;
+    // closest / any hit among the primitives [offset, offset + count)
+    void intersectLeaf(int offset, int count, const Ray& ray, Intersection& isect) const;
+    bool intersectLeafP(int offset, int count, const Ray& ray) const;
+    template <int N>
+    void intersectLeafPacket(int offset, int count, const RayPacket<N>& packet, int mask, Intersection* hits) const;
+    template <int N>
+    void IntersectPacket(const RayPacket<N>& packet, Intersection* hits, int mask) const;
+    // wide copies of the binary nodes, redone after every build and refit
+    void collapseWide();
+    template <int N>
+    int collapseBVHTree(int nodeIx, std::vector<WideBVHNode<N>>& wide);
+    template <int N>
+    Intersection IntersectWide(const std::vector<WideBVHNode<N>>& wide, const Ray& ray) const;
+    void freeBVHTree(BVHBuildNode* node);
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
+    const Layout layout;
     std::vector<Object*> primitives;
+    // set instead of primitives when the tree is built over a triangle buffer
+    TriangleBuffer* triangles = nullptr;
     int bucketSize;
-
-    void getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf);
+    // depth-first node array, first child directly follows its parent
+    std::vector<LinearBVHNode> nodes;
+    // surface area of the primitives below each node, used for area sampling
+    std::vector<float> nodeAreas;
+    // SAHCost right after the last build
+    float buildCost = 0;
+    double buildMs = 0;
+    // collapsed copies of the tree, only the one matching layout is built.
+    // packet traversal and sampling always use the binary nodes.
+    std::vector<WideBVHNode<4>> wideNodes4;
+    std::vector<WideBVHNode<8>> wideNodes8;
+
+    void getSample(int nodeIx, float p, Intersection &pos, float &pdf);
     void Sample(Intersection &pos, float &pdf);
 };
 
@@ -55,16 +163,15 @@ struct BVHBuildNode {
     Bounds3 bounds;
     BVHBuildNode *left;
     BVHBuildNode *right;
-    Object* object;
     float area;
 
 public:
+    // leaf: primitives [firstPrimOffset, firstPrimOffset + nPrimitives) of the reordered array
     int splitAxis=0, firstPrimOffset=0, nPrimitives=0;
     // BVHBuildNode Public Methods
     BVHBuildNode(){
         bounds = Bounds3();
         left = nullptr;right = nullptr;
-        object = nullptr;
     }
 };
 
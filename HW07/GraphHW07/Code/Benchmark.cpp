@@ -0,0 +1,390 @@
+//
+// Headless benchmark of the BVHs and ray queries: builds a set of scenes, traces camera,
+// shadow and diffuse bounce rays through them on one thread and writes the numbers as JSON.
+//
+//   RayTracingBenchmark [--models DIR] [--out FILE] [--size PIXELS] [--triangles N]
+//                       [--repeats N] [--layout binary|wide4|wide8]
+//
+// Scenes whose OBJ files are missing under --models are listed as skipped.
+//
+
+#include "Scene.hpp"
+#include "Triangle.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+const float EPSILON = 0.00001;
+
+struct Options
+{
+    std::string models = "./models";
+    std::string out = "benchmark.json";
+    int size = 512;                 // camera rays: size x size
+    int triangles = 250000;         // of each procedural mesh
+    int repeats = 3;                // timings are the fastest of these
+    BVHAccel::Layout layout = BVHAccel::Layout::BINARY;
+};
+
+struct RayResult
+{
+    size_t count = 0;
+    uint64_t hits = 0;
+    double seconds = 0;
+    TraversalStats work;
+};
+
+// a scene and everything it points to
+struct BenchmarkScene
+{
+    std::string name;
+    std::vector<std::unique_ptr<Material>> materials;
+    std::vector<std::unique_ptr<MeshTriangle>> meshes;
+    std::vector<std::string> meshNames;
+    Vector3f eye;
+    float fov = 40;
+};
+
+static bool fileExists(const std::string& path)
+{
+    return std::ifstream(path).good();
+}
+
+static Material* addMaterial(BenchmarkScene& scene, const Vector3f& kd, const Vector3f& emission = Vector3f(0))
+{
+    auto material = std::make_unique<Material>(DIFFUSE, emission);
+    material->Kd = kd;
+    scene.materials.push_back(std::move(material));
+    return scene.materials.back().get();
+}
+
+static void addMesh(BenchmarkScene& scene, const std::string& name, ObjMesh mesh, Material* material,
+                    BVHAccel::Layout layout)
+{
+    scene.meshes.push_back(std::make_unique<MeshTriangle>(std::move(mesh), material, layout));
+    scene.meshNames.push_back(name);
+}
+
+// latitude-longitude sphere with about triangleCount triangles, smooth and evenly sized
+static ObjMesh tessellatedSphere(int triangleCount, float radius)
+{
+    int rings = std::max(2, (int)std::sqrt(triangleCount / 4.0));
+    int segments = std::max(3, triangleCount / (2 * rings));
+    auto point = [&](int ring, int segment) {
+        float theta = M_PI * ring / rings, phi = 2 * M_PI * segment / segments;
+        return Vector3f(radius * std::sin(theta) * std::cos(phi), radius * std::cos(theta),
+                        radius * std::sin(theta) * std::sin(phi));
+    };
+    ObjMesh mesh;
+    for (int r = 0; r <= rings; ++r) {
+        for (int s = 0; s <= segments; ++s) {
+            mesh.positions.push_back(point(r, s));
+        }
+    }
+    auto vertex = [&](int ring, int segment) { return (uint32_t)(ring * (segments + 1) + segment); };
+    for (int r = 0; r < rings; ++r) {
+        for (int s = 0; s < segments; ++s) {
+            uint32_t a = vertex(r, s), b = vertex(r, s + 1), c = vertex(r + 1, s), d = vertex(r + 1, s + 1);
+            // counterclockwise from outside, triangles are hit from the front only
+            mesh.indices.insert(mesh.indices.end(), { a, b, c, b, d, c });
+        }
+    }
+    return mesh;
+}
+
+// small triangles at random places and orientations in a cube, the hard case for a BVH
+static ObjMesh triangleSoup(int triangleCount, float extent)
+{
+    PCG32 rng(2020, 7);
+    float size = extent * 2 / std::cbrt((float)triangleCount);
+    ObjMesh mesh;
+    for (int i = 0; i < triangleCount; ++i) {
+        Vector3f p(extent * (2 * rng.NextFloat() - 1), extent * (2 * rng.NextFloat() - 1),
+                   extent * (2 * rng.NextFloat() - 1));
+        for (int k = 0; k < 3; ++k) {
+            mesh.indices.push_back((uint32_t)mesh.positions.size());
+            mesh.positions.push_back(p + size * Vector3f(rng.NextFloat() - 0.5f, rng.NextFloat() - 0.5f, rng.NextFloat() - 0.5f));
+        }
+    }
+    return mesh;
+}
+
+// camera in front of the box, looking along +z like Renderer
+static Vector3f eyeFor(Bounds3 bounds)
+{
+    Vector3f center = bounds.Centroid();
+    return center - Vector3f(0, 0, 1.5f * bounds.Diagonal().norm());
+}
+
+static std::unique_ptr<BenchmarkScene> cornellBox(const Options& options, std::vector<std::string>& skipped)
+{
+    auto scene = std::make_unique<BenchmarkScene>();
+    scene->name = "cornellbox";
+    scene->eye = Vector3f(278, 273, -800);
+    const char* parts[] = { "floor", "shortbox", "tallbox", "left", "right", "light" };
+    for (const char* part : parts) {
+        std::string path = options.models + "/cornellbox/" + part + ".obj";
+        if (!fileExists(path)) {
+            skipped.push_back(scene->name + ": " + path + " not found");
+            return nullptr;
+        }
+    }
+    Material* red = addMaterial(*scene, Vector3f(0.63f, 0.065f, 0.05f));
+    Material* green = addMaterial(*scene, Vector3f(0.14f, 0.45f, 0.091f));
+    Material* white = addMaterial(*scene, Vector3f(0.725f, 0.71f, 0.68f));
+    Material* light = addMaterial(*scene, Vector3f(0.65f), Vector3f(47.8f, 38.6f, 31.1f));
+    Material* materials[] = { white, white, white, red, green, light };
+    for (int i = 0; i < 6; ++i) {
+        std::string path = options.models + "/cornellbox/" + parts[i] + ".obj";
+        addMesh(*scene, parts[i], MeshTriangle::loadMesh(path), materials[i], options.layout);
+    }
+    return scene;
+}
+
+static std::unique_ptr<BenchmarkScene> bunny(const Options& options, std::vector<std::string>& skipped)
+{
+    std::string path = options.models + "/bunny/bunny.obj";
+    if (!fileExists(path)) {
+        skipped.push_back("bunny: " + path + " not found");
+        return nullptr;
+    }
+    auto scene = std::make_unique<BenchmarkScene>();
+    scene->name = "bunny";
+    addMesh(*scene, "bunny", MeshTriangle::loadMesh(path), addMaterial(*scene, Vector3f(0.7f)), options.layout);
+    scene->eye = eyeFor(scene->meshes[0]->getBounds());
+    return scene;
+}
+
+static std::unique_ptr<BenchmarkScene> procedural(const Options& options, const std::string& name, ObjMesh mesh)
+{
+    auto scene = std::make_unique<BenchmarkScene>();
+    scene->name = name;
+    addMesh(*scene, name, std::move(mesh), addMaterial(*scene, Vector3f(0.7f)), options.layout);
+    scene->eye = eyeFor(scene->meshes[0]->getBounds());
+    return scene;
+}
+
+// the fastest of repeats runs of trace over [0, count); the work counters come from the last run
+template <typename Trace>
+static RayResult timeRays(size_t count, int repeats, Trace trace)
+{
+    RayResult result;
+    result.count = count;
+    result.seconds = std::numeric_limits<double>::infinity();
+    for (int r = 0; r < std::max(1, repeats); ++r) {
+        TraversalStats before = ThreadTraversalStats();
+        uint64_t hits = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < count; ++i) {
+            hits += trace(i) ? 1 : 0;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        result.seconds = std::min(result.seconds, seconds);
+        result.hits = hits;
+        result.work.nodesVisited = ThreadTraversalStats().nodesVisited - before.nodesVisited;
+        result.work.primitivesTested = ThreadTraversalStats().primitivesTested - before.primitivesTested;
+    }
+    return result;
+}
+
+// s as a JSON string literal, quotes included. paths may hold backslashes (Windows) or quotes
+static std::string jsonString(const std::string& s)
+{
+    std::string quoted = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        }
+        else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
+        }
+        else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+static void writeBVH(std::ostream& out, const std::string& name, const BVHStats& stats, bool last)
+{
+    char line[512];
+    std::snprintf(line, sizeof(line),
+        "        { \"name\": \"%s\", \"primitives\": %d, \"nodes\": %d, \"interior_nodes\": %d, \"leaf_nodes\": %d, "
+        "\"max_depth\": %d, \"sah_cost\": %.4f, \"build_ms\": %.3f }%s\n",
+        name.c_str(), stats.primitives, stats.interiorNodes + stats.leafNodes, stats.interiorNodes, stats.leafNodes,
+        stats.maxDepth, stats.sahCost, stats.buildMs, last ? "" : ",");
+    out << line;
+}
+
+static void writeRays(std::ostream& out, const char* kind, const RayResult& result, bool last)
+{
+    double count = std::max<double>(1, (double)result.count);
+    char line[512];
+    std::snprintf(line, sizeof(line),
+        "        \"%s\": { \"rays\": %zu, \"seconds\": %.6f, \"rays_per_sec\": %.1f, \"hit_fraction\": %.4f, "
+        "\"nodes_per_ray\": %.2f, \"primitives_per_ray\": %.2f }%s\n",
+        kind, result.count, result.seconds, result.count / std::max(result.seconds, 1e-9), result.hits / count,
+        result.work.nodesVisited / count, result.work.primitivesTested / count, last ? "" : ",");
+    out << line;
+}
+
+static void runScene(BenchmarkScene& bench, const Options& options, std::ostream& out, bool last)
+{
+    Scene scene(options.size, options.size, bench.eye);
+    scene.fov = bench.fov;
+    for (auto& mesh : bench.meshes) {
+        scene.Add(mesh.get());
+    }
+    scene.bvhLayout = options.layout;
+    scene.buildBVH();
+
+    // camera rays through pixel centres, as Renderer makes them
+    float scale = std::tan(scene.fov * 0.5f * M_PI / 180);
+    std::vector<Ray> primary;
+    for (int j = 0; j < options.size; ++j) {
+        for (int i = 0; i < options.size; ++i) {
+            float x = (2 * (i + 0.5f) / options.size - 1) * scale;
+            float y = (1 - 2 * (j + 0.5f) / options.size) * scale;
+            primary.emplace_back(scene.eyePos, normalize(Vector3f(-x, y, 1)));
+        }
+    }
+    std::vector<Intersection> hits(primary.size());
+    RayResult primaryResult = timeRays(primary.size(), options.repeats, [&](size_t i) {
+        hits[i] = scene.intersect(primary[i]);
+        return hits[i].happened;
+    });
+
+    // from every camera hit: a shadow ray to a light point and a cosine distributed bounce
+    SeedThreadRng(2020, 0);
+    Bounds3 bounds = scene.bvh->WorldBound();
+    Vector3f pointLight = bounds.Centroid() + Vector3f(0, bounds.Diagonal().norm(), -0.5f * bounds.Diagonal().norm());
+    std::vector<Ray> shadow, secondary;
+    std::vector<float> shadowDistance;
+    for (const Intersection& hit : hits) {
+        if (!hit.happened) continue;
+        Vector3f target = pointLight;
+        if (!scene.emitters.empty()) {
+            Intersection lightPoint;
+            float pdf;
+            scene.sampleLight(lightPoint, pdf);
+            target = lightPoint.coords;
+        }
+        shadow.emplace_back(hit.coords, normalize(target - hit.coords));
+        shadowDistance.push_back((target - hit.coords).norm() - EPSILON * 20);
+
+        Vector3f n = hit.normal, b, c;
+        makeTangentFrame(n, b, c);
+        float u = get_random_float(), phi = 2 * M_PI * get_random_float();
+        float r = std::sqrt(u), z = std::sqrt(std::max(0.f, 1 - u));
+        secondary.emplace_back(hit.coords, r * std::cos(phi) * b + r * std::sin(phi) * c + z * n);
+    }
+    RayResult shadowResult = timeRays(shadow.size(), options.repeats, [&](size_t i) {
+        return scene.intersectP(shadow[i], shadowDistance[i]);
+    });
+    RayResult secondaryResult = timeRays(secondary.size(), options.repeats, [&](size_t i) {
+        return scene.intersect(secondary[i]).happened;
+    });
+
+    int triangles = 0;
+    size_t meshBytes = 0;
+    double buildMs = scene.bvh->Stats().buildMs;
+    for (auto& mesh : bench.meshes) {
+        triangles += mesh->triangles.size();
+        meshBytes += mesh->triangles.Bytes();
+        buildMs += mesh->bvh->Stats().buildMs;
+    }
+    out << "    {\n";
+    out << "      \"name\": \"" << bench.name << "\",\n";
+    out << "      \"triangles\": " << triangles << ",\n";
+    out << "      \"mesh_bytes\": " << meshBytes << ",\n";
+    out << "      \"build_ms_total\": " << buildMs << ",\n";
+    out << "      \"bvh\": [\n";
+    writeBVH(out, "scene", scene.bvh->Stats(), false);
+    for (size_t i = 0; i < bench.meshes.size(); ++i) {
+        writeBVH(out, bench.meshNames[i], bench.meshes[i]->bvh->Stats(), i + 1 == bench.meshes.size());
+    }
+    out << "      ],\n";
+    out << "      \"rays\": {\n";
+    writeRays(out, "primary", primaryResult, false);
+    writeRays(out, "shadow", shadowResult, false);
+    writeRays(out, "secondary", secondaryResult, true);
+    out << "      }\n";
+    out << "    }" << (last ? "" : ",") << "\n";
+
+    std::printf("%-12s %8d triangles %5.1f B/tri  build %9.1f ms  primary %6.2f  shadow %6.2f  secondary %6.2f Mrays/s\n",
+                bench.name.c_str(), triangles, (double)meshBytes / std::max(1, triangles), buildMs,
+                primaryResult.count / primaryResult.seconds * 1e-6, shadowResult.count / shadowResult.seconds * 1e-6,
+                secondaryResult.count / secondaryResult.seconds * 1e-6);
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string key = argv[i], value = argv[i + 1];
+        if (key == "--models") options.models = value;
+        else if (key == "--out") options.out = value;
+        else if (key == "--size") options.size = std::max(1, std::atoi(value.c_str()));
+        else if (key == "--triangles") options.triangles = std::max(1, std::atoi(value.c_str()));
+        else if (key == "--repeats") options.repeats = std::max(1, std::atoi(value.c_str()));
+        else if (key == "--layout") {
+            options.layout = value == "wide4" ? BVHAccel::Layout::WIDE4
+                           : value == "wide8" ? BVHAccel::Layout::WIDE8 : BVHAccel::Layout::BINARY;
+        }
+        else {
+            std::fprintf(stderr, "unknown option %s\n", key.c_str());
+            return 1;
+        }
+    }
+
+    std::vector<std::string> skipped;
+    std::vector<std::unique_ptr<BenchmarkScene>> scenes;
+    scenes.push_back(cornellBox(options, skipped));
+    scenes.push_back(bunny(options, skipped));
+    scenes.push_back(procedural(options, "sphere", tessellatedSphere(options.triangles, 100)));
+    scenes.push_back(procedural(options, "soup", triangleSoup(options.triangles, 100)));
+    scenes.erase(std::remove(scenes.begin(), scenes.end(), nullptr), scenes.end());
+
+    std::ofstream out(options.out);
+    if (!out) {
+        std::fprintf(stderr, "cannot write %s\n", options.out.c_str());
+        return 1;
+    }
+    const char* layoutNames[] = { "binary", "wide4", "wide8" };
+    out << "{\n";
+    out << "  \"threads\": 1,\n";
+    out << "  \"layout\": \"" << layoutNames[(int)options.layout] << "\",\n";
+#ifdef RT_TRAVERSAL_STATS
+    out << "  \"traversal_stats\": true,\n";
+#else
+    out << "  \"traversal_stats\": false,\n";
+#endif
+    out << "  \"camera_rays\": " << options.size * options.size << ",\n";
+    out << "  \"repeats\": " << options.repeats << ",\n";
+    out << "  \"skipped\": [";
+    for (size_t i = 0; i < skipped.size(); ++i) {
+        out << (i ? ", " : "") << jsonString(skipped[i]);
+    }
+    out << "],\n";
+    out << "  \"scenes\": [\n";
+    for (size_t i = 0; i < scenes.size(); ++i) {
+        runScene(*scenes[i], options, out, i + 1 == scenes.size());
+    }
+    out << "  ]\n";
+    out << "}\n";
+    for (const std::string& reason : skipped) {
+        std::printf("skipped %s\n", reason.c_str());
+    }
+    std::printf("results written to %s\n", options.out.c_str());
+    return 0;
+}
@@ -5,6 +5,7 @@
 #ifndef RAYTRACING_BOUNDS3_H
 #define RAYTRACING_BOUNDS3_H
 #include "Ray.hpp"
+#include "RayPacket.hpp"
 #include "Vector.hpp"
 #include <limits>
 #include <array>
@@ -86,6 +87,11 @@ class Bounds3
     }
 
     inline bool IntersectP(const Ray& ray, const Vector3f& invDir) const;
+    // slab test that only accepts boxes entered before tMax, dirIsNeg[i] = invDir[i] < 0
+    inline bool IntersectP(const Ray& ray, const Vector3f& invDir, const int dirIsNeg[3], float tMax) const;
+    // slab test of all rays of a packet at once, returns the mask of lanes that enter before their tMax
+    template <int N>
+    inline int IntersectP(const RayPacket<N>& packet, const float* tMax) const;
 };
 
 inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir)const {
@@ -134,6 +140,53 @@ inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir)const {
     return ti <= to&& to >= 0;
 }
 
+inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir, const int dirIsNeg[3], float tMax) const
+{
+    float tMin = -std::numeric_limits<float>::infinity();
+    float tOut = std::numeric_limits<float>::infinity();
+
+    // a zero direction component gives +-inf here, or NaN when the origin lies on the slab.
+    // NaN fails both comparisons so such a slab does not restrict the interval.
+    // the exit is widened a little so flat boxes around axis-aligned triangles survive rounding.
+    auto slab = [&](float nearPlane, float farPlane, float o, float inv) {
+        float tNear = (nearPlane - o) * inv;
+        float tFar = (farPlane - o) * inv * (1 + 2 * 1.8e-7f);
+        if (tNear > tMin) tMin = tNear;
+        if (tFar < tOut) tOut = tFar;
+    };
+    slab((*this)[dirIsNeg[0]].x, (*this)[1 - dirIsNeg[0]].x, ray.origin.x, invDir.x);
+    slab((*this)[dirIsNeg[1]].y, (*this)[1 - dirIsNeg[1]].y, ray.origin.y, invDir.y);
+    slab((*this)[dirIsNeg[2]].z, (*this)[1 - dirIsNeg[2]].z, ray.origin.z, invDir.z);
+
+    return tMin <= tOut && tOut >= 0 && tMin <= tMax;
+}
+
+template <int N>
+inline int Bounds3::IntersectP(const RayPacket<N>& packet, const float* tMax) const
+{
+    using vfloat = typename SimdFloat<N>::type;
+
+    // per lane the nearer plane is min(t1, t2). unlike the scalar test, a lane with a zero
+    // direction component that starts exactly on a slab plane counts as a miss.
+    vfloat t1 = (vfloat(pMin.x) - vfloat::load(packet.ox)) * vfloat::load(packet.invx);
+    vfloat t2 = (vfloat(pMax.x) - vfloat::load(packet.ox)) * vfloat::load(packet.invx);
+    vfloat tMin = vmin(t1, t2);
+    vfloat tOut = vmax(t1, t2);
+
+    t1 = (vfloat(pMin.y) - vfloat::load(packet.oy)) * vfloat::load(packet.invy);
+    t2 = (vfloat(pMax.y) - vfloat::load(packet.oy)) * vfloat::load(packet.invy);
+    tMin = vmax(vmin(t1, t2), tMin);
+    tOut = vmin(vmax(t1, t2), tOut);
+
+    t1 = (vfloat(pMin.z) - vfloat::load(packet.oz)) * vfloat::load(packet.invz);
+    t2 = (vfloat(pMax.z) - vfloat::load(packet.oz)) * vfloat::load(packet.invz);
+    tMin = vmax(vmin(t1, t2), tMin);
+    tOut = vmin(vmax(t1, t2), tOut) * vfloat(1 + 2 * 1.8e-7f);
+
+    auto hit = (tMin <= tOut) & (tOut >= vfloat(0.f)) & (tMin <= vfloat::load(tMax));
+    return hit.bits() & packet.activeMask;
+}
+
 inline Bounds3 Union(const Bounds3& b1, const Bounds3& b2)
 {
     Bounds3 ret;
@@ -0,0 +1,162 @@
+//
+// Materials compiled for shading: every material becomes one BSDF kernel with its
+// constants worked out once in Scene::buildBVH, picked through a variant instead of
+// the switch in Material.
+//
+
+#pragma once
+
+#include "Material.hpp"
+#include "Profiler.hpp"
+#include <variant>
+
+// per shading point state: the view direction, its tangent frame and the terms
+// eval, pdf and sample of one vertex would otherwise each recompute
+struct BSDFFrame
+{
+    Vector3f wi, N, B, C;
+    float nDotv = 0;     // n.(-wi)
+    float kr = 0;        // Fresnel reflectance for wi
+    float pSpecular = 0; // chance that sample picks the specular lobe
+
+    // Material::toWorld with the frame kept
+    Vector3f toWorld(const Vector3f& a) const { return a.x * B + a.y * C + a.z * N; }
+};
+
+struct DiffuseBSDF
+{
+    Vector3f kdOverPi;
+
+    explicit DiffuseBSDF(const Material& m) : kdOverPi(m.Kd / M_PI) {}
+
+    void prepare(BSDFFrame&) const {}
+
+    Vector3f eval(const BSDFFrame& f, const Vector3f& wo) const
+    {
+        return dotProduct(f.N, wo) > 0.0f ? kdOverPi : Vector3f(0.0f);
+    }
+
+    float pdf(const BSDFFrame& f, const Vector3f& wo) const
+    {
+        float cosTheta = dotProduct(wo, f.N);
+        return cosTheta > 0.0f ? cosTheta / M_PI : 0.0f;
+    }
+
+    Vector3f sample(const BSDFFrame& f) const
+    {
+        float x_1 = get_random_float(), x_2 = get_random_float();
+        return f.toWorld(Material::sampleCosine(x_1, x_2));
+    }
+};
+
+// Material's Microface: GGX specular (Schlick-Smith G) plus Fresnel weighted Lambert
+struct MicrofacetBSDF
+{
+    Vector3f ks, kdOverPi;
+    float ior;
+    float alpha, alpha2;      // GGX width, roughness^2
+    float k;                  // Schlick-Smith G constant, (roughness + 1)^2 / 8
+    float specularWeight, diffuseWeight;
+    bool sampleSpecular;
+
+    explicit MicrofacetBSDF(const Material& m)
+        : ks(m.Ks), kdOverPi(m.Kd / M_PI), ior(m.ior),
+          alpha(m.roughness * m.roughness), alpha2(alpha * alpha),
+          k((m.roughness + 1) * (m.roughness + 1) * 0.125f),
+          specularWeight(luminance(m.Ks)), diffuseWeight(luminance(m.Kd)),
+          sampleSpecular(m.roughness > 0)
+    {}
+
+    void prepare(BSDFFrame& f) const
+    {
+        f.kr = fresnelDielectric(dotProduct(f.wi, f.N), ior);
+        if (sampleSpecular && f.nDotv > 0) {
+            float specular = specularWeight * f.kr;
+            float diffuse = diffuseWeight * (1 - f.kr);
+            f.pSpecular = specular + diffuse > 0 ? specular / (specular + diffuse) : 0;
+        }
+    }
+
+    Vector3f eval(const BSDFFrame& f, const Vector3f& wo) const
+    {
+        float lDotn = dotProduct(wo, f.N);
+        if (lDotn <= 0.0f) return Vector3f(0.0f);
+
+        Vector3f h = normalize(-f.wi + wo);
+        float hDotn = dotProduct(h, f.N);
+        float d = (alpha2 - 1) * hDotn * hDotn + 1;
+        // clamped like Material so roughness 0 stays finite
+        float D = alpha2 / std::max(float(M_PI * d * d), EPSILON);
+        float G = lDotn / (lDotn * (1 - k) + k) * (f.nDotv / (f.nDotv * (1 - k) + k));
+        float brdf = f.kr * D * G / (4 * f.nDotv * lDotn);
+        return ks * brdf + kdOverPi * (1 - f.kr);
+    }
+
+    float pdf(const BSDFFrame& f, const Vector3f& wo) const
+    {
+        float cosTheta = dotProduct(wo, f.N);
+        if (cosTheta <= 0.0f) return 0.0f;
+
+        float pdfDiffuse = cosTheta / M_PI;
+        if (f.pSpecular <= 0) return pdfDiffuse;
+
+        Vector3f h = normalize(-f.wi + wo);
+        float hDotn = std::max(0.0f, dotProduct(h, f.N));
+        float pdfSpecular = Material::smithG1(f.nDotv, alpha) * Material::ggxD(hDotn, alpha) / (4 * f.nDotv);
+        return f.pSpecular * pdfSpecular + (1 - f.pSpecular) * pdfDiffuse;
+    }
+
+    Vector3f sample(const BSDFFrame& f) const
+    {
+        float x_0 = get_random_float(), x_1 = get_random_float(), x_2 = get_random_float();
+        if (x_0 < f.pSpecular) {
+            // view direction in the local frame, as Material::toLocal(-wi, N)
+            Vector3f v(dotProduct(-f.wi, f.B), dotProduct(-f.wi, f.C), f.nDotv);
+            Vector3f h = Material::sampleGGXVNDF(v, alpha, x_1, x_2);
+            return f.toWorld(2.0f * dotProduct(v, h) * h - v);
+        }
+        return f.toWorld(Material::sampleCosine(x_1, x_2));
+    }
+};
+
+class CompiledMaterial
+{
+public:
+    explicit CompiledMaterial(const Material& m)
+        : bsdf(m.m_type == Microface ? Kernel(MicrofacetBSDF(m)) : Kernel(DiffuseBSDF(m)))
+    {}
+
+    // shading frame for a ray arriving along wi at a surface with normal N
+    BSDFFrame frame(const Vector3f& wi, const Vector3f& N) const
+    {
+        BSDFFrame f;
+        f.wi = wi;
+        f.N = N;
+        f.nDotv = -dotProduct(wi, N);
+        makeTangentFrame(N, f.B, f.C);
+        std::visit([&](const auto& kernel) { kernel.prepare(f); }, bsdf);
+        return f;
+    }
+
+    Vector3f eval(const BSDFFrame& f, const Vector3f& wo) const
+    {
+        RT_PROFILE_COUNT(BSDFEval, 1);
+        return std::visit([&](const auto& kernel) { return kernel.eval(f, wo); }, bsdf);
+    }
+
+    float pdf(const BSDFFrame& f, const Vector3f& wo) const
+    {
+        RT_PROFILE_COUNT(BSDFPdf, 1);
+        return std::visit([&](const auto& kernel) { return kernel.pdf(f, wo); }, bsdf);
+    }
+
+    Vector3f sample(const BSDFFrame& f) const
+    {
+        RT_PROFILE_COUNT(BSDFSample, 1);
+        return std::visit([&](const auto& kernel) { return kernel.sample(f); }, bsdf);
+    }
+
+private:
+    using Kernel = std::variant<DiffuseBSDF, MicrofacetBSDF>;
+    Kernel bsdf;
+};
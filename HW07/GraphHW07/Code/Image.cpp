@@ -0,0 +1,202 @@
+//
+// Image output, see Image.hpp. The float formats are written little endian.
+//
+
+#include "Image.hpp"
+#include "ThreadPool.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+static_assert(sizeof(Vector3f) == 3 * sizeof(float), "pixels are read as packed float triples");
+
+static uint32_t floatToBits(float x)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+static float bitsToFloat(uint32_t bits)
+{
+    float x;
+    std::memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+template <typename Curve>
+ByteEncoder::ByteEncoder(Curve curve)
+{
+    auto toByte = [&](float x) { return (unsigned char)(255 * curve(x)); };
+    const int shift = 23 - kMantissaBits;
+    const int bucketCount = kOctaves << kMantissaBits;
+    buckets.resize(bucketCount + 1);
+
+    for (int i = 0; i < bucketCount; ++i) {
+        uint32_t first = (kFirstBucket + i) << shift;
+        uint32_t last = first + (1u << shift) - 1;
+        // the first bucket also takes everything below 2^-16
+        unsigned char value = toByte(i == 0 ? 0.f : bitsToFloat(first));
+        assert(toByte(bitsToFloat(last)) <= value + 1);
+        buckets[i] = Bucket{ std::numeric_limits<float>::infinity(), value };
+        if (toByte(bitsToFloat(last)) == value) continue;
+        // bisect for the first float of the bucket that gets the next byte
+        while (first < last) {
+            uint32_t mid = first + (last - first) / 2;
+            if (toByte(bitsToFloat(mid)) > value) last = mid;
+            else first = mid + 1;
+        }
+        buckets[i].threshold = bitsToFloat(first);
+    }
+    // exactly 1
+    buckets[bucketCount] = Bucket{ std::numeric_limits<float>::infinity(), toByte(1.f) };
+}
+
+ByteEncoder ByteEncoder::Gamma(float exponent)
+{
+    return ByteEncoder([exponent](float x) { return std::pow(x, exponent); });
+}
+
+ByteEncoder ByteEncoder::SRGB()
+{
+    return ByteEncoder([](float x) {
+        return x <= 0.0031308f ? 12.92f * x : 1.055f * std::pow(x, 1 / 2.4f) - 0.055f;
+    });
+}
+
+unsigned char ByteEncoder::Encode(float x) const
+{
+    // NaN fails the first test and becomes 0
+    x = x > 0.f ? x : 0.f;
+    x = x < 1.f ? x : 1.f;
+    uint32_t bucket = floatToBits(x) >> (23 - kMantissaBits);
+    bucket = bucket > kFirstBucket ? bucket - kFirstBucket : 0;
+    const Bucket& b = buckets[bucket];
+    return (unsigned char)(b.value + (x >= b.threshold ? 1 : 0));
+}
+
+void ByteEncoder::Encode(const Vector3f* pixels, size_t count, unsigned char* rgb, ThreadPool* pool) const
+{
+    // channels are independent, so the framebuffer is one flat float array
+    const float* channels = &pixels[0].x;
+    size_t channelCount = count * 3;
+    auto encodeRange = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            rgb[i] = Encode(channels[i]);
+        }
+    };
+
+    const size_t chunk = 1 << 16;
+    int chunkCount = (int)((channelCount + chunk - 1) / chunk);
+    if (!pool || chunkCount < 2) {
+        encodeRange(0, channelCount);
+        return;
+    }
+    pool->Run(chunkCount, [&](int chunkIx, int) {
+        encodeRange(chunkIx * chunk, std::min(channelCount, (chunkIx + 1) * chunk));
+    });
+}
+
+bool WritePPM(const std::string& path, int width, int height, const Vector3f* pixels,
+              const ByteEncoder& encoder, ThreadPool* pool)
+{
+    std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+    std::vector<unsigned char> file(header.size() + (size_t)width * height * 3);
+    std::copy(header.begin(), header.end(), file.begin());
+    encoder.Encode(pixels, (size_t)width * height, file.data() + header.size(), pool);
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(file.data()), file.size());
+    return (bool)out;
+}
+
+bool WritePFM(const std::string& path, int width, int height, const Vector3f* pixels)
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    // a negative scale marks little endian data
+    out << "PF\n" << width << " " << height << "\n-1.0\n";
+    for (int j = height - 1; j >= 0; --j) {
+        out.write(reinterpret_cast<const char*>(pixels + (size_t)j * width), (size_t)width * sizeof(Vector3f));
+    }
+    return (bool)out;
+}
+
+// header attribute: name, type name, value size, value
+static void appendAttribute(std::string& header, const char* name, const char* type, const void* value, int32_t size)
+{
+    header.append(name).push_back('\0');
+    header.append(type).push_back('\0');
+    header.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    header.append(static_cast<const char*>(value), size);
+}
+
+bool WriteEXR(const std::string& path, int width, int height, const Vector3f* pixels)
+{
+    std::string header;
+    const int32_t magic = 20000630, version = 2; // version 2, single part scanline file
+    header.append(reinterpret_cast<const char*>(&magic), 4);
+    header.append(reinterpret_cast<const char*>(&version), 4);
+
+    // channels sorted by name: pixel type 2 (FLOAT), pLinear and 3 reserved bytes, x and y sampling
+    std::string channels;
+    for (const char* name : { "B", "G", "R" }) {
+        const int32_t description[4] = { 2, 0, 1, 1 };
+        channels.append(name).push_back('\0');
+        channels.append(reinterpret_cast<const char*>(description), sizeof(description));
+    }
+    channels.push_back('\0');
+    appendAttribute(header, "channels", "chlist", channels.data(), (int32_t)channels.size());
+    const unsigned char noCompression = 0, increasingY = 0;
+    appendAttribute(header, "compression", "compression", &noCompression, 1);
+    const int32_t window[4] = { 0, 0, width - 1, height - 1 };
+    appendAttribute(header, "dataWindow", "box2i", window, sizeof(window));
+    appendAttribute(header, "displayWindow", "box2i", window, sizeof(window));
+    appendAttribute(header, "lineOrder", "lineOrder", &increasingY, 1);
+    const float one = 1.f, center[2] = { 0.f, 0.f };
+    appendAttribute(header, "pixelAspectRatio", "float", &one, sizeof(one));
+    appendAttribute(header, "screenWindowCenter", "v2f", center, sizeof(center));
+    appendAttribute(header, "screenWindowWidth", "float", &one, sizeof(one));
+    header.push_back('\0');
+
+    // one block per scanline: y, byte count, then the B, G and R rows
+    const int32_t blockBytes = width * 3 * (int32_t)sizeof(float);
+    std::vector<uint64_t> offsets(height);
+    for (int j = 0; j < height; ++j) {
+        offsets[j] = header.size() + (uint64_t)height * sizeof(uint64_t) + (uint64_t)j * (8 + blockBytes);
+    }
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(header.data(), header.size());
+    out.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+    std::vector<float> block((size_t)width * 3);
+    for (int32_t j = 0; j < height; ++j) {
+        const Vector3f* row = pixels + (size_t)j * width;
+        for (int i = 0; i < width; ++i) {
+            block[i] = row[i].z;
+            block[width + i] = row[i].y;
+            block[2 * width + i] = row[i].x;
+        }
+        out.write(reinterpret_cast<const char*>(&j), sizeof(j));
+        out.write(reinterpret_cast<const char*>(&blockBytes), sizeof(blockBytes));
+        out.write(reinterpret_cast<const char*>(block.data()), blockBytes);
+    }
+    return (bool)out;
+}
+
+bool WriteImage(const std::string& path, int width, int height, const Vector3f* pixels,
+                const ByteEncoder& encoder, ThreadPool* pool)
+{
+    auto endsWith = [&](const char* extension) {
+        size_t n = std::strlen(extension);
+        if (path.size() < n) return false;
+        return std::equal(extension, extension + n, path.end() - n,
+                          [](char a, char b) { return a == std::tolower((unsigned char)b); });
+    };
+    if (endsWith(".pfm")) return WritePFM(path, width, height, pixels);
+    if (endsWith(".exr")) return WriteEXR(path, width, height, pixels);
+    return WritePPM(path, width, height, pixels, encoder, pool);
+}
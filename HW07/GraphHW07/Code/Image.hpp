@@ -0,0 +1,58 @@
+//
+// Writing the framebuffer: 8 bit PPM through a transfer curve table, or the linear
+// float radiance as PFM or OpenEXR for HDR viewers and image comparisons.
+//
+
+#pragma once
+
+#include "Vector.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class ThreadPool;
+
+// Maps linear values to bytes: clamp to [0, 1], apply a transfer curve, scale by 255 and
+// truncate, without evaluating the curve per pixel. Floats in [2^-16, 1) are split into
+// buckets by exponent and the top 8 mantissa bits; the curve rises by less than one byte
+// over a bucket, so a bucket stores its byte and the value where the next one starts.
+class ByteEncoder
+{
+public:
+    // x^exponent with exponent in (0, 1], 1 is linear. the tracer's images always used 0.6
+    static ByteEncoder Gamma(float exponent);
+    // the sRGB transfer curve
+    static ByteEncoder SRGB();
+
+    unsigned char Encode(float x) const;
+    // count pixels to 3 * count bytes, split over pool when there is one
+    void Encode(const Vector3f* pixels, size_t count, unsigned char* rgb, ThreadPool* pool = nullptr) const;
+
+private:
+    template <typename Curve>
+    explicit ByteEncoder(Curve curve);
+
+    static constexpr int kMantissaBits = 8;
+    static constexpr int kOctaves = 16;
+    // bits of 2^-16 shifted down to a bucket index
+    static constexpr uint32_t kFirstBucket = (127u - kOctaves) << kMantissaBits;
+
+    // one lookup reads both
+    struct Bucket
+    {
+        float threshold;
+        uint32_t value;
+    };
+    std::vector<Bucket> buckets;
+};
+
+// binary P6, one write
+bool WritePPM(const std::string& path, int width, int height, const Vector3f* pixels,
+              const ByteEncoder& encoder, ThreadPool* pool = nullptr);
+// linear RGB floats, bottom row first as the format wants
+bool WritePFM(const std::string& path, int width, int height, const Vector3f* pixels);
+// scanline OpenEXR, uncompressed 32 bit float R, G, B
+bool WriteEXR(const std::string& path, int width, int height, const Vector3f* pixels);
+// by the extension of path: .pfm and .exr keep the floats, anything else is PPM
+bool WriteImage(const std::string& path, int width, int height, const Vector3f* pixels,
+                const ByteEncoder& encoder, ThreadPool* pool = nullptr);
@@ -0,0 +1,97 @@
+//
+// A placed copy of an object. The prototype (usually a MeshTriangle with its own BVH)
+// is built once and shared, an instance only stores the transform, so the scene BVH
+// is the top level and the prototypes' BVHs are the bottom level.
+//
+
+#pragma once
+
+#include "Object.hpp"
+#include "Transform.hpp"
+#include <cmath>
+
+class Instance : public Object
+{
+public:
+    // the prototype is not owned and must outlive the instance. light sampling
+    // assumes the transform scales all areas alike (rotation, translation, uniform scale)
+    Instance(Object* prototype, const Transform& objectToWorld)
+        : prototype(prototype)
+    {
+        SetTransform(objectToWorld);
+    }
+
+    // move the instance; the scene BVH has to be updated afterwards
+    void SetTransform(const Transform& transform)
+    {
+        objectToWorld = transform;
+        worldToObject = transform.Inverse();
+        areaScale = std::pow(std::fabs(transform.Determinant()), 2.0f / 3.0f);
+    }
+
+    bool intersect(const Ray& ray)
+    {
+        return prototype->intersect(toObject(ray));
+    }
+
+    bool intersect(const Ray& ray, float& tnear, uint32_t& index) const { return false; }
+
+    // the ray is moved into object space at this TLAS leaf, the hit is moved back
+    Intersection getIntersection(Ray ray)
+    {
+        Intersection inter = prototype->getIntersection(toObject(ray));
+        if (inter.happened) {
+            inter.coords = objectToWorld.Point(inter.coords);
+            inter.normal = normalize(objectToWorld.Normal(inter.normal));
+            inter.distance = (inter.coords - ray.origin).norm();
+            inter.obj = this;
+        }
+        return inter;
+    }
+
+    void getSurfaceProperties(const Vector3f& P, const Vector3f& I, const uint32_t& index, const Vector2f& uv,
+                              Vector3f& N, Vector2f& st) const
+    {
+        prototype->getSurfaceProperties(worldToObject.Point(P), worldToObject.Vector(I), index, uv, N, st);
+        N = normalize(objectToWorld.Normal(N));
+    }
+
+    Vector3f evalDiffuseColor(const Vector2f& st) const { return prototype->evalDiffuseColor(st); }
+
+    // read from the prototype every time, so they follow its deformation too
+    Bounds3 getBounds() { return objectToWorld(prototype->getBounds()); }
+
+    float getArea() { return prototype->getArea() * areaScale; }
+
+    void Sample(Intersection& pos, float& pdf)
+    {
+        prototype->Sample(pos, pdf);
+        pos.coords = objectToWorld.Point(pos.coords);
+        pos.normal = normalize(objectToWorld.Normal(pos.normal));
+        pos.obj = this;
+        // area density: the same points spread over areaScale times the area
+        pdf /= areaScale;
+    }
+
+    bool hasEmit() { return prototype->hasEmit(); }
+
+    Material* getMaterial() { return prototype->getMaterial(); }
+
+    Object* prototype;
+    Transform objectToWorld, worldToObject;
+
+private:
+    // object space ray with a unit direction, so the prototype's distances stay
+    // consistent inside its BVH. they differ from world ones by the factor |dir|
+    Ray toObject(const Ray& ray) const
+    {
+        Vector3f dir = worldToObject.Vector(ray.direction);
+        float dirScale = dir.norm();
+        Ray objectRay(worldToObject.Point(ray.origin), dir / dirScale);
+        objectRay.t_min = ray.t_min * dirScale;
+        objectRay.t_max = ray.t_max * dirScale;
+        return objectRay;
+    }
+
+    float areaScale;
+};
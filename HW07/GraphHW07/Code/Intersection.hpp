@@ -6,6 +6,7 @@
 #define RAYTRACING_INTERSECTION_H
 #include "Vector.hpp"
 #include "Material.hpp"
+#include <limits>
 class Object;
 class Sphere;
 
@@ -19,6 +20,12 @@ struct Intersection
         obj =nullptr;
         m=nullptr;
     }
+    // distance as the float bound of the single precision box and packet tests. before any
+    // hit it is DBL_MAX, which a float can't hold, so it is clamped rather than cast
+    float distanceBound() const
+    {
+        return (float)std::min(distance, (double)std::numeric_limits<float>::max());
+    }
     bool happened;
     Vector3f coords;
     Vector3f tcoords;
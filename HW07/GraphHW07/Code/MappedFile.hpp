@@ -0,0 +1,34 @@
+//
+// Read-only memory mapping of a whole file, and replacing a file in one step.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// read-only view of a whole file
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // nullptr when the file could not be opened or is empty
+    const unsigned char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const unsigned char* bytes = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    void* file = nullptr;
+    void* mapping = nullptr;
+#endif
+};
+
+// rename from to to, replacing an existing to in one step: readers see the old file or the
+// new one, and a crash in between leaves one of them in place
+bool RenameReplacing(const std::string& from, const std::string& to);
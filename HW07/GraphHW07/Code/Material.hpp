@@ -10,6 +10,42 @@
 
 inline std::normal_distribution<> stdNormal;
 
+class CompiledMaterial;
+
+// tangents B, C completing the unit normal N to an orthonormal frame, shading directions are
+// x * B + y * C + z * N in it
+inline void makeTangentFrame(const Vector3f& N, Vector3f& B, Vector3f& C)
+{
+    if (std::fabs(N.x) > std::fabs(N.y)) {
+        float invLen = 1.0f / std::sqrt(N.x * N.x + N.z * N.z);
+        C = Vector3f(N.z * invLen, 0.0f, -N.x * invLen);
+    }
+    else {
+        float invLen = 1.0f / std::sqrt(N.y * N.y + N.z * N.z);
+        C = Vector3f(0.0f, N.z * invLen, -N.y * invLen);
+    }
+    B = crossProduct(C, N);
+}
+
+// Fresnel reflectance of a dielectric with the given ior, cosi = I.N
+inline float fresnelDielectric(float cosi, float ior)
+{
+    cosi = clamp(-1, 1, cosi);
+    float etai = 1, etat = ior;
+    if (cosi > 0) { std::swap(etai, etat); }
+    // Compute sini using Snell's law
+    float sint = etai / etat * sqrtf(std::max(0.f, 1 - cosi * cosi));
+    // Total internal reflection
+    if (sint >= 1) {
+        return 1;
+    }
+    float cost = sqrtf(std::max(0.f, 1 - sint * sint));
+    cosi = fabsf(cosi);
+    float Rs = ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
+    float Rp = ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
+    return (Rs * Rs + Rp * Rp) / 2;
+}
+
 enum MaterialType {
     DIFFUSE,
     Microface
@@ -59,41 +95,72 @@ private:
     // \param[out] kr is the amount of light reflected
     void fresnel(const Vector3f& I, const Vector3f& N, const float& ior, float& kr) const
     {
-        float cosi = clamp(-1, 1, dotProduct(I, N));
-        float etai = 1, etat = ior;
-        if (cosi > 0) { std::swap(etai, etat); }
-        // Compute sini using Snell's law
-        float sint = etai / etat * sqrtf(std::max(0.f, 1 - cosi * cosi));
-        // Total internal reflection
-        if (sint >= 1) {
-            kr = 1;
-        }
-        else {
-            float cost = sqrtf(std::max(0.f, 1 - sint * sint));
-            cosi = fabsf(cosi);
-            float Rs = ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
-            float Rp = ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
-            kr = (Rs * Rs + Rp * Rp) / 2;
-        }
+        kr = fresnelDielectric(dotProduct(I, N), ior);
         // As a consequence of the conservation of energy, transmittance is given by:
         // kt = 1 - kr;
     }
 
     Vector3f toWorld(const Vector3f& a, const Vector3f& N) {
         Vector3f B, C;
-        if (std::fabs(N.x) > std::fabs(N.y)) {
-            float invLen = 1.0f / std::sqrt(N.x * N.x + N.z * N.z);
-            C = Vector3f(N.z * invLen, 0.0f, -N.x * invLen);
-        }
-        else {
-            float invLen = 1.0f / std::sqrt(N.y * N.y + N.z * N.z);
-            C = Vector3f(0.0f, N.z * invLen, -N.y * invLen);
-        }
-        B = crossProduct(C, N);
+        makeTangentFrame(N, B, C);
         return a.x * B + a.y * C + a.z * N;
     }
 
-    float __NdfDistributionGGX(Vector3f h, Vector3f n) {
+    Vector3f toLocal(const Vector3f& a, const Vector3f& N) {
+        // inverse of toWorld, same tangent frame
+        Vector3f B, C;
+        makeTangentFrame(N, B, C);
+        return Vector3f(dotProduct(a, B), dotProduct(a, C), dotProduct(a, N));
+    }
+
+public:
+    // local frame sampling helpers, also used by the kernels in CompiledMaterial.hpp
+
+    // cosine weighted direction around +z, pdf cos/pi
+    static Vector3f sampleCosine(float u1, float u2) {
+        float r = std::sqrt(u1), phi = 2 * M_PI * u2;
+        return Vector3f(r * std::cos(phi), r * std::sin(phi), std::sqrt(std::max(0.0f, 1.0f - u1)));
+    }
+
+    // GGX normal distribution and Smith masking, as used by the sampling pdf
+    static float ggxD(float nDoth, float alpha) {
+        float alpha2 = alpha * alpha;
+        float d = (alpha2 - 1) * nDoth * nDoth + 1;
+        return alpha2 / (M_PI * d * d);
+    }
+
+    static float smithG1(float nDotv, float alpha) {
+        float alpha2 = alpha * alpha;
+        return 2 * nDotv / (nDotv + std::sqrt(alpha2 + (1 - alpha2) * nDotv * nDotv));
+    }
+
+    // half vector drawn from the GGX normals visible from v (local frame, v.z > 0)
+    // Heitz 2018, "Sampling the GGX Distribution of Visible Normals"
+    static Vector3f sampleGGXVNDF(const Vector3f& v, float alpha, float u1, float u2) {
+        Vector3f vh = normalize(Vector3f(alpha * v.x, alpha * v.y, v.z));
+        float lensq = vh.x * vh.x + vh.y * vh.y;
+        Vector3f t1 = lensq > 0 ? Vector3f(-vh.y, vh.x, 0) / std::sqrt(lensq) : Vector3f(1, 0, 0);
+        Vector3f t2 = crossProduct(vh, t1);
+        float r = std::sqrt(u1), phi = 2 * M_PI * u2;
+        float p1 = r * std::cos(phi), p2 = r * std::sin(phi);
+        float s = 0.5f * (1.0f + vh.z);
+        p2 = (1.0f - s) * std::sqrt(std::max(0.0f, 1.0f - p1 * p1)) + s * p2;
+        Vector3f nh = p1 * t1 + p2 * t2 + std::sqrt(std::max(0.0f, 1.0f - p1 * p1 - p2 * p2)) * vh;
+        return normalize(Vector3f(alpha * nh.x, alpha * nh.y, std::max(0.0f, nh.z)));
+    }
+
+private:
+    // chance of sampling the specular lobe of Microface, by the lobes' share of reflected energy
+    float specularProbability(const Vector3f& wi, const Vector3f& N) {
+        if (roughness <= 0 || dotProduct(-wi, N) <= 0) return 0;
+        float kr;
+        fresnel(wi, N, ior, kr);
+        float specular = luminance(Ks) * kr;
+        float diffuse = luminance(Kd) * (1 - kr);
+        return specular + diffuse > 0 ? specular / (specular + diffuse) : 0;
+    }
+
+    float __NdfDistributionGGX(const Vector3f& h, const Vector3f& n) {
         float alpha = roughness * roughness;
         // I like to expose potential problem so I don't use max function to make hDotn positive.
         float hDotn = dotProduct(h, n);
@@ -110,7 +177,7 @@ private:
         return nom / std::max(denom, EPSILON);
     }
 
-    float __ShelterCoefficientGGX(Vector3f n, Vector3f v) {
+    float __ShelterCoefficientGGX(const Vector3f& n, const Vector3f& v) {
         assert(fabs(n.norm() - 1.0) < 1e-4);
         assert(fabs(v.norm() - 1.0) < 1e-4);
         
@@ -122,7 +189,7 @@ private:
         return nDotv / (nDotv * (1 - k) + k);
     }
     
-    float __GCoefficientGGX(Vector3f n, Vector3f l, Vector3f i) {
+    float __GCoefficientGGX(const Vector3f& n, const Vector3f& l, const Vector3f& i) {
         return __ShelterCoefficientGGX(n, l) * __ShelterCoefficientGGX(n, i);
     }
 
@@ -135,6 +202,9 @@ public:
     Vector3f Kd, Ks;
     float specularExponent;
     //Texture tex;
+    // shading kernel with precomputed constants, made by Scene::buildBVH.
+    // the integrators use it, eval/pdf/sample below stay as the reference.
+    CompiledMaterial* compiled = nullptr;
 
     inline Material(MaterialType t = DIFFUSE, Vector3f e = Vector3f(0, 0, 0));
     inline MaterialType getType();
@@ -176,21 +246,24 @@ Vector3f Material::sample(const Vector3f& wi, const Vector3f& N) {
     switch (m_type) {
     case DIFFUSE:
     {
+        // ҼȨ, cos
         float x_1 = get_random_float(), x_2 = get_random_float();
-        float z = std::fabs(1.0f - 2.0f * x_1);
-        float r = std::sqrt(1.0f - z * z), phi = 2 * M_PI * x_2;
-        Vector3f localRay(r * std::cos(phi), r * std::sin(phi), z);
-        return toWorld(localRay, N);
+        return toWorld(sampleCosine(x_1, x_2), N);
 
         break;
     }
     case Microface:
     {
-        float x_1 = get_random_float(), x_2 = get_random_float();
-        float z = std::fabs(1.0f - 2.0f * x_1);
-        float r = std::sqrt(1.0f - z * z), phi = 2 * M_PI * x_2;
-        Vector3f localRay(r * std::cos(phi), r * std::sin(phi), z);
-        return toWorld(localRay, N);
+        // ѡ(GGXɼ߲)(Ҳ)
+        float pSpecular = specularProbability(wi, N);
+        float x_0 = get_random_float(), x_1 = get_random_float(), x_2 = get_random_float();
+        if (x_0 < pSpecular) {
+            Vector3f v = toLocal(-wi, N);
+            Vector3f h = sampleGGXVNDF(v, roughness * roughness, x_1, x_2);
+            Vector3f localRay = 2.0f * dotProduct(v, h) * h - v;
+            return toWorld(localRay, N);
+        }
+        return toWorld(sampleCosine(x_1, x_2), N);
 
         break;
     }
@@ -202,18 +275,30 @@ float Material::pdf(const Vector3f& wi, const Vector3f& wo, const Vector3f& N) {
     switch (m_type) {
     case DIFFUSE:
     {
-        if (dotProduct(wo, N) > 0.0f)
-            return 0.5f / M_PI;
+        float cosTheta = dotProduct(wo, N);
+        if (cosTheta > 0.0f)
+            return cosTheta / M_PI;
         else
             return 0.0f;
         break;
     }
     case Microface:
     {
-        if (dotProduct(wo, N) > 0.0f)
-            return 0.5f / M_PI;
-        else
+        float cosTheta = dotProduct(wo, N);
+        if (cosTheta <= 0.0f)
             return 0.0f;
+
+        float pdfDiffuse = cosTheta / M_PI;
+        float pSpecular = specularProbability(wi, N);
+        if (pSpecular <= 0)
+            return pdfDiffuse;
+
+        // reflection by h: pdf(wo) = Dv(h) / (4 wo.h) = G1(v) D(h) / (4 n.v)
+        float alpha = roughness * roughness;
+        Vector3f h = normalize(-wi + wo);
+        float nDotv = dotProduct(-wi, N);
+        float pdfSpecular = smithG1(nDotv, alpha) * ggxD(std::max(0.0f, dotProduct(h, N)), alpha) / (4 * nDotv);
+        return pSpecular * pdfSpecular + (1 - pSpecular) * pdfDiffuse;
         break;
     }
     }
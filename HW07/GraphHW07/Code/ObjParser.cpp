@@ -0,0 +1,429 @@
+//
+// Parallel OBJ parsing, see ObjParser.hpp. Every chunk is parsed into its own arrays; indices
+// are made absolute and the arrays concatenated once the counts of all chunks are known.
+//
+
+#include "ObjParser.hpp"
+#include "MappedFile.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <limits>
+#include <thread>
+
+namespace {
+
+// chunks are at least this big, smaller files are not worth a thread
+const size_t kMinChunkBytes = 1 << 20;
+
+// a face index as read: absolute, or relative to the attributes defined before it in its
+// chunk (negative in the file), which only becomes absolute once the chunk's offset is known
+const int64_t kAbsent = -1;
+const int64_t kRelative = int64_t(1) << 40;
+
+struct Chunk
+{
+    const char* begin;
+    const char* end;
+    std::vector<Vector3f> positions, normals;
+    std::vector<Vector2f> uvs;
+    // position, uv and normal index of every triangle corner
+    std::vector<int64_t> corners[3];
+    // local line of every triangle, to report indices found out of range after merging
+    std::vector<uint32_t> triangleLines;
+    bool anyUv = false, anyNormal = false;
+
+    size_t lineCount = 0;
+    // first problem, at local line errorLine
+    std::string error;
+    size_t errorLine = 0;
+};
+
+inline bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+const char* skipSpaces(const char* p, const char* end)
+{
+    while (p < end && isSpace(*p)) ++p;
+    return p;
+}
+
+// strtof on a copy of the token at p, for whatever the fast paths do not take (nan, inf, very
+// long or extreme numbers). p is returned when there is no number
+const char* parseFloatSlow(const char* p, const char* end, float& value)
+{
+    char token[64];
+    size_t length = 0;
+    while (p + length < end && length + 1 < sizeof(token) && !isSpace(p[length]) && p[length] != '/') {
+        token[length] = p[length];
+        ++length;
+    }
+    token[length] = '\0';
+    char* parsed = token;
+    value = std::strtof(token, &parsed);
+    return p + (parsed - token);
+}
+
+// the same float as strtof. decimal mantissas that fit a float or a double are converted with
+// one correctly rounded multiplication or division by an exact power of ten (Clinger's fast path)
+const char* parseFloat(const char* p, const char* end, float& value)
+{
+    static const float floatPowers[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+    static const double doublePowers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                           1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    const char* start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p++ == '-';
+    }
+    // up to 19 significant digits, the rest only moves the decimal exponent
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool anyDigit = false, truncated = false;
+    for (; p < end && isDigit(*p); ++p) {
+        anyDigit = true;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0;
+        }
+        else {
+            ++exponent;
+            truncated |= *p != '0';
+        }
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && isDigit(*p); ++p) {
+            anyDigit = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+                --exponent;
+            }
+            else {
+                truncated |= *p != '0';
+            }
+        }
+    }
+    if (!anyDigit) return parseFloatSlow(start, end, value);
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char* q = p + 1;
+        bool negativeExponent = false;
+        if (q < end && (*q == '-' || *q == '+')) {
+            negativeExponent = *q++ == '-';
+        }
+        if (q < end && isDigit(*q)) {
+            int e = 0;
+            for (; q < end && isDigit(*q); ++q) {
+                e = std::min(e * 10 + (*q - '0'), 100000);
+            }
+            exponent += negativeExponent ? -e : e;
+            p = q;
+        }
+    }
+    if (p < end && !isSpace(*p) && *p != '/') return parseFloatSlow(start, end, value);
+
+    if (!truncated && mantissa <= (1u << 24) && exponent >= -10 && exponent <= 10) {
+        float f = (float)mantissa;
+        f = exponent < 0 ? f / floatPowers[-exponent] : f * floatPowers[exponent];
+        value = negative ? -f : f;
+        return p;
+    }
+    if (!truncated && mantissa <= (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+        double d = (double)mantissa;
+        d = exponent < 0 ? d / doublePowers[-exponent] : d * doublePowers[exponent];
+        // rounding the double to float gives strtof's float unless the double fell exactly
+        // halfway between two floats, or the float would be denormal or overflow
+        uint64_t bits;
+        std::memcpy(&bits, &d, sizeof(bits));
+        bool halfway = (bits & ((uint64_t(1) << 29) - 1)) == (uint64_t(1) << 28);
+        if (!halfway && (d == 0 || (d >= FLT_MIN && d <= FLT_MAX))) {
+            value = negative ? -(float)d : (float)d;
+            return p;
+        }
+    }
+    return parseFloatSlow(start, end, value);
+}
+
+const char* parseInt(const char* p, const char* end, int64_t& value)
+{
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p++ == '-';
+    }
+    if (p >= end || !isDigit(*p)) return nullptr;
+    int64_t v = 0;
+    for (; p < end && isDigit(*p); ++p) {
+        v = std::min<int64_t>(v * 10 + (*p - '0'), kRelative / 4);
+    }
+    value = negative ? -v : v;
+    return p;
+}
+
+// index as written to the encoded form, false for 0
+bool encodeIndex(int64_t index, size_t countSoFar, int64_t& encoded)
+{
+    if (index > 0) encoded = index - 1;
+    else if (index < 0) encoded = kRelative + (int64_t)countSoFar + index;
+    else return false;
+    return true;
+}
+
+// float arguments of a v/vt/vn line, missing ones are an error
+template <int N>
+bool parseFloats(const char*& p, const char* lineEnd, float* values)
+{
+    for (int k = 0; k < N; ++k) {
+        p = skipSpaces(p, lineEnd);
+        const char* q = parseFloat(p, lineEnd, values[k]);
+        if (q == p) return false;
+        p = q;
+    }
+    return true;
+}
+
+void parseChunk(Chunk& chunk)
+{
+    // corners of the current face, kept between lines so long files allocate once
+    std::vector<int64_t> face[3];
+    auto fail = [&](const char* message) {
+        if (chunk.error.empty()) {
+            chunk.error = message;
+            chunk.errorLine = chunk.lineCount;
+        }
+    };
+
+    for (const char* p = chunk.begin; p < chunk.end; ++chunk.lineCount) {
+        const char* lineEnd = static_cast<const char*>(std::memchr(p, '\n', chunk.end - p));
+        if (!lineEnd) lineEnd = chunk.end;
+        const char* q = skipSpaces(p, lineEnd);
+        p = lineEnd + 1;
+        if (lineEnd - q < 2 || (!isSpace(q[1]) && !(q[0] == 'v' && (q[1] == 't' || q[1] == 'n')))) continue;
+
+        float values[3];
+        if (q[0] == 'v' && isSpace(q[1])) {
+            q += 2;
+            if (!parseFloats<3>(q, lineEnd, values)) fail("bad vertex position");
+            else chunk.positions.emplace_back(values[0], values[1], values[2]);
+        }
+        else if (q[0] == 'v' && q[1] == 't' && (q + 2 == lineEnd || isSpace(q[2]))) {
+            // a third texture coordinate is ignored
+            q += 2;
+            if (!parseFloats<2>(q, lineEnd, values)) fail("bad texture coordinate");
+            else chunk.uvs.emplace_back(values[0], values[1]);
+        }
+        else if (q[0] == 'v' && q[1] == 'n' && (q + 2 == lineEnd || isSpace(q[2]))) {
+            q += 2;
+            if (!parseFloats<3>(q, lineEnd, values)) fail("bad vertex normal");
+            else chunk.normals.emplace_back(values[0], values[1], values[2]);
+        }
+        else if (q[0] == 'f') {
+            for (auto& corners : face) corners.clear();
+            bool valid = true;
+            for (q = skipSpaces(q + 1, lineEnd); q < lineEnd && valid; q = skipSpaces(q, lineEnd)) {
+                // v, v/vt, v//vn or v/vt/vn
+                int64_t index[3] = { 0, 0, 0 };
+                int64_t encoded[3] = { kAbsent, kAbsent, kAbsent };
+                q = parseInt(q, lineEnd, index[0]);
+                valid = q && encodeIndex(index[0], chunk.positions.size(), encoded[0]);
+                for (int k = 1; k < 3 && valid && q < lineEnd && *q == '/'; ++k) {
+                    ++q;
+                    if (k == 1 && q < lineEnd && *q == '/') continue;
+                    size_t countSoFar = k == 1 ? chunk.uvs.size() : chunk.normals.size();
+                    q = parseInt(q, lineEnd, index[k]);
+                    valid = q && encodeIndex(index[k], countSoFar, encoded[k]);
+                }
+                valid = valid && (q == lineEnd || isSpace(*q));
+                // q is null after a token that is no number, it must not reach skipSpaces
+                if (!valid) break;
+                for (int k = 0; k < 3; ++k) face[k].push_back(encoded[k]);
+            }
+            if (!valid || face[0].size() < 3) {
+                fail("bad face");
+                continue;
+            }
+            for (size_t i = 1; i + 1 < face[0].size(); ++i) {
+                for (int k = 0; k < 3; ++k) {
+                    chunk.corners[k].push_back(face[k][0]);
+                    chunk.corners[k].push_back(face[k][i]);
+                    chunk.corners[k].push_back(face[k][i + 1]);
+                }
+                chunk.triangleLines.push_back((uint32_t)chunk.lineCount);
+            }
+            for (int64_t uv : face[1]) chunk.anyUv |= uv != kAbsent;
+            for (int64_t normal : face[2]) chunk.anyNormal |= normal != kAbsent;
+        }
+    }
+}
+
+// f(i) for i in [0, count) on up to threadCount threads, the calling one included
+template <typename F>
+void parallelFor(int count, int threadCount, const F& f)
+{
+    std::atomic<int> next{ 0 };
+    auto worker = [&]() {
+        for (int i = next++; i < count; i = next++) f(i);
+    };
+    std::vector<std::future<void>> helpers;
+    for (int t = 1; t < std::min(threadCount, count); ++t) {
+        helpers.push_back(std::async(std::launch::async, worker));
+    }
+    worker();
+    for (auto& helper : helpers) helper.get();
+}
+
+} // namespace
+
+bool LoadObj(const std::string& path, ObjMesh& mesh, std::string* error, int threadCount)
+{
+    auto fail = [&](const std::string& message) {
+        if (error) *error = path + ": " + message;
+        return false;
+    };
+    mesh = ObjMesh();
+    MappedFile file(path);
+    if (!file.data()) return fail("cannot read the file or it is empty");
+    const char* text = reinterpret_cast<const char*>(file.data());
+    size_t size = file.size();
+
+    if (threadCount <= 0) threadCount = (int)std::max(1u, std::thread::hardware_concurrency());
+    // a few chunks per thread so one slow chunk does not hold up the others
+    size_t chunkCount = std::max<size_t>(1, std::min<size_t>(size / kMinChunkBytes, (size_t)threadCount * 4));
+    std::vector<Chunk> chunks;
+    const char* begin = text;
+    for (size_t c = 1; c <= chunkCount && begin < text + size; ++c) {
+        const char* end = text + size * c / chunkCount;
+        if (end < begin) end = begin;
+        // chunks end after a line break
+        const char* lineBreak = static_cast<const char*>(std::memchr(end, '\n', text + size - end));
+        end = c == chunkCount || !lineBreak ? text + size : lineBreak + 1;
+        Chunk chunk;
+        chunk.begin = begin;
+        chunk.end = end;
+        chunks.push_back(std::move(chunk));
+        begin = end;
+    }
+    parallelFor((int)chunks.size(), threadCount, [&](int c) { parseChunk(chunks[c]); });
+
+    // where every chunk's attributes and triangles start in the merged arrays
+    size_t lines = 0;
+    std::vector<size_t> lineStart, positionStart, uvStart, normalStart, cornerStart;
+    size_t positionCount = 0, uvCount = 0, normalCount = 0, cornerCount = 0;
+    bool anyUv = false, anyNormal = false;
+    for (const Chunk& chunk : chunks) {
+        if (!chunk.error.empty()) {
+            return fail("line " + std::to_string(lines + chunk.errorLine + 1) + ": " + chunk.error);
+        }
+        lineStart.push_back(lines);
+        lines += chunk.lineCount;
+        positionStart.push_back(positionCount);
+        uvStart.push_back(uvCount);
+        normalStart.push_back(normalCount);
+        cornerStart.push_back(cornerCount);
+        positionCount += chunk.positions.size();
+        uvCount += chunk.uvs.size();
+        normalCount += chunk.normals.size();
+        cornerCount += chunk.corners[0].size();
+        anyUv |= chunk.anyUv;
+        anyNormal |= chunk.anyNormal;
+    }
+    if (positionCount >= ObjMesh::kNoIndex || uvCount >= ObjMesh::kNoIndex || normalCount >= ObjMesh::kNoIndex) {
+        return fail("too many vertices for 32 bit indices");
+    }
+
+    mesh.positions.resize(positionCount);
+    mesh.uvs.resize(uvCount);
+    mesh.normals.resize(normalCount);
+    mesh.indices.resize(cornerCount);
+    if (anyUv) mesh.uvIndices.resize(cornerCount);
+    if (anyNormal) mesh.normalIndices.resize(cornerCount);
+    // first line of each chunk with an index out of range
+    const size_t noLine = std::numeric_limits<size_t>::max();
+    std::vector<size_t> badLine(chunks.size(), noLine);
+    parallelFor((int)chunks.size(), threadCount, [&](int c) {
+        Chunk& chunk = chunks[c];
+        std::copy(chunk.positions.begin(), chunk.positions.end(), mesh.positions.begin() + positionStart[c]);
+        std::copy(chunk.uvs.begin(), chunk.uvs.end(), mesh.uvs.begin() + uvStart[c]);
+        std::copy(chunk.normals.begin(), chunk.normals.end(), mesh.normals.begin() + normalStart[c]);
+
+        std::vector<uint32_t>* targets[3] = { &mesh.indices, &mesh.uvIndices, &mesh.normalIndices };
+        const size_t starts[3] = { positionStart[c], uvStart[c], normalStart[c] };
+        const size_t counts[3] = { positionCount, uvCount, normalCount };
+        for (int k = 0; k < 3; ++k) {
+            if (targets[k]->empty()) continue;
+            uint32_t* out = targets[k]->data() + cornerStart[c];
+            bool required = k == 0;
+            for (size_t i = 0; i < chunk.corners[k].size(); ++i) {
+                int64_t encoded = chunk.corners[k][i];
+                int64_t index = encoded >= kRelative / 2 ? (int64_t)starts[k] + (encoded - kRelative) : encoded;
+                if (encoded == kAbsent && !required) {
+                    *out++ = ObjMesh::kNoIndex;
+                    continue;
+                }
+                if (index < 0 || index >= (int64_t)counts[k]) {
+                    badLine[c] = std::min(badLine[c], lineStart[c] + chunk.triangleLines[i / 3]);
+                }
+                *out++ = (uint32_t)index;
+            }
+        }
+        // the chunk's copies are not needed any more
+        chunk = Chunk();
+    });
+    size_t firstBadLine = *std::min_element(badLine.begin(), badLine.end());
+    if (firstBadLine != noLine) {
+        mesh = ObjMesh();
+        return fail("line " + std::to_string(firstBadLine + 1) + ": a face refers to a vertex that does not exist");
+    }
+    return true;
+}
+
+void MergeAttributeIndices(ObjMesh& mesh)
+{
+    const uint32_t none = ObjMesh::kNoIndex;
+    bool useNormals = !mesh.normalIndices.empty()
+        && std::find(mesh.normalIndices.begin(), mesh.normalIndices.end(), none) == mesh.normalIndices.end();
+    bool useUvs = !mesh.uvIndices.empty();
+    if (!useNormals && !useUvs) {
+        mesh.normals.clear();
+        mesh.uvs.clear();
+        mesh.normalIndices.clear();
+        mesh.uvIndices.clear();
+        return;
+    }
+
+    // the vertices made from each position are chained from first[position], a position
+    // rarely has more than the few that meet at a uv seam or a crease
+    std::vector<uint32_t> first(mesh.positions.size(), none);
+    std::vector<uint32_t> next, position, uv, normal;
+    for (size_t i = 0; i < mesh.indices.size(); ++i) {
+        uint32_t p = mesh.indices[i];
+        uint32_t t = useUvs ? mesh.uvIndices[i] : none;
+        uint32_t n = useNormals ? mesh.normalIndices[i] : none;
+        uint32_t vertex = first[p];
+        while (vertex != none && (uv[vertex] != t || normal[vertex] != n)) vertex = next[vertex];
+        if (vertex == none) {
+            vertex = (uint32_t)position.size();
+            position.push_back(p);
+            uv.push_back(t);
+            normal.push_back(n);
+            next.push_back(first[p]);
+            first[p] = vertex;
+        }
+        mesh.indices[i] = vertex;
+    }
+
+    std::vector<Vector3f> positions(position.size()), normals(useNormals ? position.size() : 0);
+    std::vector<Vector2f> uvs(useUvs ? position.size() : 0);
+    for (size_t v = 0; v < position.size(); ++v) {
+        positions[v] = mesh.positions[position[v]];
+        if (useNormals) normals[v] = mesh.normals[normal[v]];
+        if (useUvs && uv[v] != none) uvs[v] = mesh.uvs[uv[v]];
+    }
+    mesh.positions.swap(positions);
+    mesh.normals.swap(normals);
+    mesh.uvs.swap(uvs);
+    mesh.normalIndices.clear();
+    mesh.uvIndices.clear();
+}
@@ -0,0 +1,41 @@
+//
+// Wavefront OBJ reader for large meshes, in place of objl::Loader: the file is mapped, cut
+// into chunks at line breaks and the chunks are parsed in parallel by hand-rolled number
+// parsers that allocate nothing per token. Only geometry is read (v, vt, vn, f), groups,
+// objects and materials are ignored, so the whole file becomes one mesh.
+//
+
+#pragma once
+
+#include "Vector.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// triangles of an OBJ as index buffers into the attribute arrays of the file
+struct ObjMesh
+{
+    std::vector<Vector3f> positions;   // v
+    std::vector<Vector2f> uvs;         // vt
+    std::vector<Vector3f> normals;     // vn
+
+    // three 0-based indices per triangle. polygons are split into fans around their first corner
+    std::vector<uint32_t> indices;
+    // same layout as indices, empty when no face names the attribute. corners of faces
+    // that leave it out hold kNoIndex
+    std::vector<uint32_t> uvIndices;
+    std::vector<uint32_t> normalIndices;
+
+    static constexpr uint32_t kNoIndex = 0xffffffffu;
+
+    size_t triangleCount() const { return indices.size() / 3; }
+};
+
+// parse path into mesh with up to threadCount threads (0: one per core). false, with the
+// reason in error, when the file cannot be read or a face refers to a missing vertex
+bool LoadObj(const std::string& path, ObjMesh& mesh, std::string* error = nullptr, int threadCount = 0);
+
+// one index per corner for every attribute: each distinct (position, uv, normal) combination of
+// the faces becomes a vertex, normals and uvs become per vertex and their index arrays are
+// cleared. normals are dropped unless every corner has one, corners without a uv get (0, 0)
+void MergeAttributeIndices(ObjMesh& mesh);
@@ -0,0 +1,52 @@
+//
+// Checks of LoadObj on small files: well formed faces load, malformed and out of range
+// ones fail with the line they are on instead of crashing the loader.
+//
+
+#include "ObjParser.hpp"
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+const float EPSILON = 0.00001;
+
+struct ObjCase
+{
+    const char* name;
+    const char* text;
+    bool loads;
+    const char* error;   // part of the expected error message, when it does not load
+    size_t triangles;    // when it does
+};
+
+int main()
+{
+    const char* vertices = "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\nvt 0 0\nvn 0 0 1\n";
+    const ObjCase cases[] = {
+        { "quad", "f 1 2 3 4\n", true, "", 2 },
+        { "all index forms", "f 1 2/1 3//1\nf 1/1/1 3/1/1 -1/1/1\n", true, "", 2 },
+        { "letter index", "f 1 2 3\nf 1 2 x\n", false, "line 8: bad face", 0 },
+        { "missing uv index", "f 1/ 2 3\n", false, "line 7: bad face", 0 },
+        { "missing normal index", "f 1 2 3//\n", false, "line 7: bad face", 0 },
+        { "two corners", "f 1 2\n", false, "line 7: bad face", 0 },
+        { "zero index", "f 0 1 2\n", false, "line 7: bad face", 0 },
+        { "index past the end", "f 1 2 3\nf 1 2 9\n", false, "line 8: a face refers to a vertex that does not exist", 0 },
+    };
+
+    const std::string path = "ObjParserTest.obj";
+    int failed = 0;
+    for (const ObjCase& c : cases) {
+        std::ofstream(path, std::ios::binary) << vertices << c.text;
+        ObjMesh mesh;
+        std::string error;
+        bool loaded = LoadObj(path, mesh, &error, 1);
+        bool ok = loaded == c.loads
+            && (loaded ? mesh.triangleCount() == c.triangles : error.find(c.error) != std::string::npos);
+        printf("%-22s %s%s%s\n", c.name, ok ? "ok" : "FAILED", error.empty() ? "" : ", ", error.c_str());
+        failed += ok ? 0 : 1;
+    }
+    std::remove(path.c_str());
+
+    printf(failed == 0 ? "PASSED\n" : "FAILED\n");
+    return failed == 0 ? 0 : 1;
+}
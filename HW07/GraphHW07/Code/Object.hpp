@@ -9,6 +9,7 @@
 #include "global.hpp"
 #include "Bounds3.hpp"
 #include "Ray.hpp"
+#include "RayPacket.hpp"
 #include "Intersection.hpp"
 
 class Object
@@ -16,6 +17,7 @@ class Object
 public:
     Object() {}
     virtual ~Object() {}
+    // any-hit test: true if something is hit with ray.t_min < t < ray.t_max
     virtual bool intersect(const Ray& ray) = 0;
     virtual bool intersect(const Ray& ray, float &, uint32_t &) const = 0;
     virtual Intersection getIntersection(Ray _ray) = 0;
@@ -25,6 +27,25 @@ public:
     virtual float getArea()=0;
     virtual void Sample(Intersection &pos, float &pdf)=0;
     virtual bool hasEmit()=0;
+    virtual Material* getMaterial()=0;
+
+    // closest hits of a ray packet. only lanes set in mask are tested, and hits[lane] is only
+    // replaced by a closer hit. objects without a SIMD path test the lanes one by one.
+    virtual void getIntersection4(const RayPacket4& packet, int mask, Intersection* hits) { getIntersectionLanes(packet, mask, hits); }
+    virtual void getIntersection8(const RayPacket8& packet, int mask, Intersection* hits) { getIntersectionLanes(packet, mask, hits); }
+
+protected:
+    template <int N>
+    void getIntersectionLanes(const RayPacket<N>& packet, int mask, Intersection* hits)
+    {
+        for (int lane = 0; lane < N; ++lane) {
+            if (!(mask & (1 << lane))) continue;
+            Intersection inter = getIntersection(packet.Get(lane));
+            if (inter.happened && inter.distance < hits[lane].distance) {
+                hits[lane] = inter;
+            }
+        }
+    }
 };
 
 
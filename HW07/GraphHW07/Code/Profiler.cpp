@@ -0,0 +1,142 @@
+//
+// Merging and writing the profile, see Profiler.hpp.
+//
+
+#include "Profiler.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <map>
+
+Profiler& Profiler::Get()
+{
+    static Profiler profiler;
+    return profiler;
+}
+
+ProfileThread& Profiler::AddThread()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    // owned here, so a thread's numbers outlive the thread
+    threads.push_back(std::make_unique<ProfileThread>());
+    return *threads.back();
+}
+
+void Profiler::Reset()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& thread : threads) {
+        thread->counters.fill(0);
+        thread->spans.clear();
+    }
+    epoch = std::chrono::steady_clock::now();
+}
+
+std::array<uint64_t, (size_t)ProfileCounter::Count> Profiler::Totals() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::array<uint64_t, (size_t)ProfileCounter::Count> totals{};
+    for (auto& thread : threads) {
+        for (size_t i = 0; i < totals.size(); ++i) {
+            totals[i] += thread->counters[i];
+        }
+    }
+    return totals;
+}
+
+const char* Profiler::CounterName(ProfileCounter counter)
+{
+    static const char* names[] = { "bvh_queries", "bvh_nodes", "bvh_primitives", "triangle_tests",
+                                   "light_samples", "bsdf_eval", "bsdf_sample", "bsdf_pdf", "path_vertices" };
+    static_assert(sizeof(names) / sizeof(names[0]) == (size_t)ProfileCounter::Count, "a name per counter");
+    return names[(size_t)counter];
+}
+
+// busy time and task count per worker
+static std::map<int, std::pair<int64_t, int>> workerLoads(const std::vector<std::unique_ptr<ProfileThread>>& threads)
+{
+    std::map<int, std::pair<int64_t, int>> loads;
+    for (auto& thread : threads) {
+        for (const ProfileSpan& span : thread->spans) {
+            loads[span.worker].first += span.durationNs;
+            loads[span.worker].second += 1;
+        }
+    }
+    return loads;
+}
+
+void Profiler::PrintSummary() const
+{
+#ifdef RT_PROFILE
+    auto totals = Totals();
+    uint64_t queries = std::max<uint64_t>(1, totals[(size_t)ProfileCounter::BVHQueries]);
+    std::printf("\nprofile counters:\n");
+    for (size_t i = 0; i < totals.size(); ++i) {
+        std::printf("  %-16s %14llu\n", CounterName((ProfileCounter)i), (unsigned long long)totals[i]);
+    }
+    std::printf("  nodes per query %.2f, primitives per query %.2f\n",
+                totals[(size_t)ProfileCounter::BVHNodes] / (double)queries,
+                totals[(size_t)ProfileCounter::BVHPrimitives] / (double)queries);
+#endif
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto loads = workerLoads(threads);
+    if (loads.empty()) return;
+    int64_t maxBusy = 0, totalBusy = 0;
+    std::printf("\nworker load:\n");
+    for (auto& load : loads) {
+        std::printf("  worker %2d %6d tasks %10.1f ms\n", load.first, load.second.second, load.second.first * 1e-6);
+        maxBusy = std::max(maxBusy, load.second.first);
+        totalBusy += load.second.first;
+    }
+    // 1 when every worker was busy for as long as the slowest one
+    std::printf("  balance %.3f (mean / max busy time)\n", totalBusy / (double)loads.size() / std::max<int64_t>(1, maxBusy));
+}
+
+bool Profiler::WriteTrace(const std::string& path) const
+{
+    auto totals = Totals();
+    std::lock_guard<std::mutex> lock(mutex);
+    std::ofstream out(path, std::ios::trunc);
+    char line[512];
+    out << "{\"traceEvents\":[\n";
+    // one row per worker
+    auto loads = workerLoads(threads);
+    bool first = true;
+    for (auto& load : loads) {
+        std::snprintf(line, sizeof(line),
+            "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}",
+            first ? "" : ",\n", load.first, load.first);
+        out << line;
+        first = false;
+    }
+    int64_t endNs = 0;
+    for (auto& thread : threads) {
+        for (const ProfileSpan& span : thread->spans) {
+            // timestamps are in microseconds
+            std::snprintf(line, sizeof(line),
+                "%s{\"name\":\"%s\",\"cat\":\"render\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                "\"args\":{\"x0\":%d,\"y0\":%d,\"x1\":%d,\"y1\":%d,\"tiles\":%d,\"samples\":%d}}",
+                first ? "" : ",\n", span.name, span.worker, span.startNs * 1e-3, span.durationNs * 1e-3,
+                span.x0, span.y0, span.x1, span.y1, span.tiles, span.samples);
+            out << line;
+            first = false;
+            endNs = std::max(endNs, span.startNs + span.durationNs);
+        }
+    }
+#ifdef RT_PROFILE
+    // the counter totals as one sample at the end of the render
+    out << (first ? "" : ",\n");
+    std::snprintf(line, sizeof(line), "{\"name\":\"counters\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{", endNs * 1e-3);
+    out << line;
+    for (size_t i = 0; i < totals.size(); ++i) {
+        out << (i ? "," : "") << "\"" << CounterName((ProfileCounter)i) << "\":" << totals[i];
+    }
+    out << "}}";
+#else
+    (void)totals;
+    (void)endNs;
+#endif
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return (bool)out;
+}
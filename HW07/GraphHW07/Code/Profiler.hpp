@@ -0,0 +1,110 @@
+//
+// Where render time goes: per-thread counters on the hot paths (BVH queries, triangle tests,
+// light samples, BSDF calls), compiled in only with RT_PROFILE, and wall time spans of the
+// render tasks written as Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev).
+// Every thread writes only its own block, the blocks are merged once a render is done.
+//
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum class ProfileCounter
+{
+    BVHQueries,     // BVHAccel intersect calls, a packet counts once
+    BVHNodes,       // nodes they tested
+    BVHPrimitives,  // primitives in the leaves they reached
+    TriangleTests,  // ray-triangle tests, one per SIMD lane
+    LightSamples,   // Scene::sampleLight
+    BSDFEval,
+    BSDFSample,
+    BSDFPdf,
+    PathVertices,   // surface hits shaded by castRay, castPath or the wavefront engine
+    Count
+};
+
+// one render task: the tiles it covered and how long it took
+struct ProfileSpan
+{
+    const char* name;
+    int worker;
+    int64_t startNs, durationNs;
+    int x0, y0, x1, y1;  // bounds of its tiles
+    int tiles;
+    int samples;
+};
+
+struct ProfileThread
+{
+    std::array<uint64_t, (size_t)ProfileCounter::Count> counters{};
+    std::vector<ProfileSpan> spans;
+};
+
+class Profiler
+{
+public:
+    static Profiler& Get();
+
+    // a new block for the calling thread, use ThreadProfile()
+    ProfileThread& AddThread();
+    // zero every block and restart the clock, only while no thread records
+    void Reset();
+    std::array<uint64_t, (size_t)ProfileCounter::Count> Totals() const;
+    // counter totals and per worker busy time
+    void PrintSummary() const;
+    bool WriteTrace(const std::string& path) const;
+
+    int64_t Now() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    static const char* CounterName(ProfileCounter counter);
+
+    // spans are recorded only when set
+    bool recordSpans = false;
+
+private:
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<ProfileThread>> threads;
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+};
+
+inline ProfileThread& ThreadProfile()
+{
+    thread_local ProfileThread* block = &Profiler::Get().AddThread();
+    return *block;
+}
+
+// records a span from construction to destruction when spans are on
+class ProfileScope
+{
+public:
+    ProfileScope(const char* name, int worker, int x0, int y0, int x1, int y1, int tiles, int samples)
+        : span{ name, worker, 0, 0, x0, y0, x1, y1, tiles, samples }, enabled(Profiler::Get().recordSpans)
+    {
+        if (enabled) span.startNs = Profiler::Get().Now();
+    }
+    ~ProfileScope()
+    {
+        if (!enabled) return;
+        span.durationNs = Profiler::Get().Now() - span.startNs;
+        ThreadProfile().spans.push_back(span);
+    }
+
+private:
+    ProfileSpan span;
+    bool enabled;
+};
+
+#ifdef RT_PROFILE
+#define RT_PROFILE_COUNT(counter, n) (ThreadProfile().counters[(size_t)ProfileCounter::counter] += (n))
+#else
+#define RT_PROFILE_COUNT(counter, n) ((void)0)
+#endif
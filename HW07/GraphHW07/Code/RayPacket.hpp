@@ -0,0 +1,54 @@
+//
+// Struct-of-arrays packets of coherent rays (camera rays of neighbouring pixels).
+//
+
+#pragma once
+
+#include "Ray.hpp"
+#include "Simd.hpp"
+
+template <int N>
+struct RayPacket
+{
+    static constexpr int size = N;
+
+    alignas(32) float ox[N], oy[N], oz[N];
+    alignas(32) float dx[N], dy[N], dz[N];
+    alignas(32) float invx[N], invy[N], invz[N];
+    // bit i set -> lane i holds a ray
+    int activeMask = 0;
+
+    RayPacket()
+    {
+        for (int i = 0; i < N; ++i) {
+            ox[i] = oy[i] = oz[i] = 0;
+            dx[i] = dy[i] = 0;
+            dz[i] = invz[i] = 1;
+            invx[i] = invy[i] = std::numeric_limits<float>::infinity();
+        }
+    }
+
+    void Set(int lane, const Ray& ray)
+    {
+        ox[lane] = ray.origin.x; oy[lane] = ray.origin.y; oz[lane] = ray.origin.z;
+        dx[lane] = ray.direction.x; dy[lane] = ray.direction.y; dz[lane] = ray.direction.z;
+        invx[lane] = ray.direction_inv.x; invy[lane] = ray.direction_inv.y; invz[lane] = ray.direction_inv.z;
+        activeMask |= 1 << lane;
+    }
+
+    Ray Get(int lane) const
+    {
+        return Ray(Vector3f(ox[lane], oy[lane], oz[lane]), Vector3f(dx[lane], dy[lane], dz[lane]));
+    }
+};
+
+using RayPacket4 = RayPacket<4>;
+using RayPacket8 = RayPacket<8>;
+
+// index of the lowest set bit, mask must not be zero
+inline int firstLane(int mask)
+{
+    int lane = 0;
+    while (!(mask & (1 << lane))) ++lane;
+    return lane;
+}
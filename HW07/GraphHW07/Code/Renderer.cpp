@@ -1,8 +1,14 @@
 //
 // Created by goksu on 2/25/20.
 //
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include "MappedFile.hpp"
 #include "Scene.hpp"
+#include "Profiler.hpp"
 #include "Renderer.hpp"
 #include <thread>
 
@@ -11,23 +17,104 @@ inline float deg2rad(const float& deg) { return deg * M_PI / 180.0; }
 
 const float EPSILON = 0.00001;
 
-void Renderer::operator() (Scene const& scene, float const scale, float const imageAspectRatio, int const rowIx) {
-    // less fine-gradient, one thread handle one row
-    float x, y;
-    size_t baseIx = rowIx * scene.width;
+void Renderer::operator() (Scene const& scene, float const scale, float const imageAspectRatio, Tile const& tile) {
+    RenderTiles(scene, scale, imageAspectRatio, &tile, 1, 0, spp, renderSeed, framebuffer.data(), invSpp);
+}
+
+int Renderer::TilesPerTask(int samples) const
+{
+    // one task handles one tile, tiles are small enough that slow regions get spread over the threads
+    if (engine == Engine::MEGAKERNEL) return 1;
+    int pathsPerTile = std::max(1, tileSize * tileSize * samples);
+    return std::max(1, wavefrontPaths / pathsPerTile);
+}
+
+void Renderer::RenderTiles(const Scene& scene, float scale, float imageAspectRatio, const Tile* tiles, int count,
+                           int workerIx, int samples, uint64_t passSeed, Vector3f* target, float weight, PixelStats* stats)
+{
+    if (engine == Engine::WAVEFRONT) {
+        if ((int)wavefronts.size() <= workerIx) {
+            wavefronts.resize(workerIx + 1);
+        }
+        // the tiles of a batch are consecutive, the span covers their bounds
+        Tile bounds = tiles[0];
+        for (int t = 1; t < count; ++t) {
+            bounds = Tile{ std::min(bounds.x0, tiles[t].x0), std::min(bounds.y0, tiles[t].y0),
+                           std::max(bounds.x1, tiles[t].x1), std::max(bounds.y1, tiles[t].y1) };
+        }
+        ProfileScope span("batch", workerIx, bounds.x0, bounds.y0, bounds.x1, bounds.y1, count, samples);
+        wavefronts[workerIx].Render(scene, scale, imageAspectRatio, tiles, count, samples, wavefrontPaths, passSeed,
+                                    target, weight, stats);
+        return;
+    }
+    for (int t = 0; t < count; ++t) {
+        ProfileScope span("tile", workerIx, tiles[t].x0, tiles[t].y0, tiles[t].x1, tiles[t].y1, 1, samples);
+        RenderTile(scene, scale, imageAspectRatio, tiles[t], samples, passSeed, target, weight, stats);
+    }
+}
+
+void Renderer::RenderTile(const Scene& scene, float scale, float imageAspectRatio, const Tile& tile,
+                          int samples, uint64_t passSeed, Vector3f* target, float weight, PixelStats* stats)
+{
+    for (int j = tile.y0; j < tile.y1; ++j) {
+        size_t baseIx = (size_t)j * scene.width;
+
+        for (int i0 = tile.x0; i0 < tile.x1; i0 += PrimaryPacket::size) {
+            // camera rays of neighbouring pixels are traced together, and only once since
+            // every sample of a pixel shares its primary ray
+            PrimaryPacket packet;
+            Vector3f dirs[PrimaryPacket::size];
+            Intersection hits[PrimaryPacket::size];
+            int count = std::min(PrimaryPacket::size, tile.x1 - i0);
+            for (int lane = 0; lane < count; ++lane) {
+                // generate primary ray
+                dirs[lane] = cameraRayDirection(scene, scale, imageAspectRatio, i0 + lane, j);
+                packet.Set(lane, Ray(scene.eyePos, dirs[lane]));
+            }
+            scene.intersect(packet, hits);
+
+            for (int lane = 0; lane < count; ++lane) {
+                size_t pixelIx = baseIx + i0 + lane;
+                if (stats && stats[pixelIx].converged) continue;
+                Ray primaryRay(scene.eyePos, dirs[lane]);
+                SeedThreadRng(passSeed, pixelIx);
+
+                // cache-line friendly
+                for (int k = 0; k < samples; ++k) {
+                    Vector3f radiance = scene.radiance(primaryRay, hits[lane]);
+                    target[pixelIx] += radiance * weight;
+                    if (stats) stats[pixelIx].Add(luminance(radiance));
+                }
+            }
+        }
+    }
+}
 
-    y = (1 - 2 * (rowIx + 0.5) * scene.invHeight) * scale;
-    for (int i = 0; i < scene.width; ++i) {
-        // generate primary ray
-        x = (2 * (i + 0.5) * scene.invWidth - 1) * imageAspectRatio * scale;
+void Renderer::BeginRender()
+{
+    renderSeed = fixedSeed ? seed : ((uint64_t)std::random_device{}() << 32 | std::random_device{}());
+    Profiler::Get().Reset();
+    Profiler::Get().recordSpans = !tracePath.empty();
+}
 
-        Ray primaryRay(scene.eyePos, normalize(Vector3f(-x, y, 1)));
+void Renderer::EndRender() const
+{
+    Profiler::Get().PrintSummary();
+    if (!tracePath.empty() && !Profiler::Get().WriteTrace(tracePath)) {
+        std::cout << "\nfailed to write trace " << tracePath << "\n";
+    }
+}
 
-        // cache-line friendly
-        for (int k = 0; k < spp; ++k) {
-            framebuffer[baseIx + i] += scene.castRay(primaryRay, 0, false) * invSpp;
+std::vector<Tile> Renderer::MakeTiles(const Scene& scene) const
+{
+    int size = std::max(1, tileSize);
+    std::vector<Tile> tiles;
+    for (int y = 0; y < scene.height; y += size) {
+        for (int x = 0; x < scene.width; x += size) {
+            tiles.push_back(Tile{ x, y, std::min(x + size, scene.width), std::min(y + size, scene.height) });
         }
     }
+    return tiles;
 }
 
 // The main render function. This where we iterate over all pixels in the image,
@@ -38,89 +125,273 @@ void Renderer::RenderMultipleThread(const Scene& scene)
     float scale = tan(deg2rad(scene.fov * 0.5));
     float imageAspectRatio = scene.width / (float)scene.height;
     framebuffer = std::vector<Vector3f>(scene.width * scene.height);
+    BeginRender();
 
-    std::vector<std::thread> threads(threadCount);
+    if (!pool || pool->size() != threadCount) {
+        pool = std::make_unique<ThreadPool>(threadCount);
+    }
 
     std::cout << "SPP: " << spp << "\n";
 
-    int curRowIx = 0;
-    while (curRowIx < scene.height) {
-        for (int k = 0; k < threadCount; ++k) {
-            // 仰뱨, ɾ˵ĺ-->sceneΪstd::ref(scene), *thisҲҪΪstd::ref(*this)
-            threads[k] = std::thread(std::ref(*this), std::ref(scene), scale, imageAspectRatio, curRowIx++);
+    std::vector<Tile> tiles = MakeTiles(scene);
+    int tilesPerTask = TilesPerTask(spp);
+    // the workers must not resize wavefronts while others use it
+    wavefronts.resize(std::max((size_t)pool->size(), wavefronts.size()));
+    pool->Run(((int)tiles.size() + tilesPerTask - 1) / tilesPerTask,
+        [&](int taskIx, int workerIx) {
+            int first = taskIx * tilesPerTask;
+            int count = std::min(tilesPerTask, (int)tiles.size() - first);
+            RenderTiles(scene, scale, imageAspectRatio, &tiles[first], count, workerIx,
+                        spp, renderSeed, framebuffer.data(), invSpp);
+        },
+        UpdateProgress);
+    UpdateProgress(1.f);
+    EndRender();
 
-            if (curRowIx >= scene.height) {
-                break;
-            }
-        }
+    SaveOutput(scene.width, scene.height);
+}
 
-        for (int k = 0; k < threads.size(); ++k) {
-            if (threads[k].joinable()) {
-                threads[k].join();
-                UpdateProgress((float)curRowIx / scene.height);
-            }
-        }
+void Renderer::Render(const Scene& scene)
+{
+    framebuffer = std::vector<Vector3f>(scene.width * scene.height);
+
+    float scale = tan(deg2rad(scene.fov * 0.5));
+    float imageAspectRatio = scene.width / (float)scene.height;
+    BeginRender();
+
+    std::cout << "SPP: " << spp << "\n";
+    for (int j = 0; j < scene.height; ++j) {
+        (*this)(scene, scale, imageAspectRatio, Tile{ 0, j, scene.width, j + 1 });
+        float process = j / (float)scene.height;
+        UpdateProgress(process);
     }
     UpdateProgress(1.f);
+    EndRender();
+
+    SaveOutput(scene.width, scene.height);
+}
 
-    // save framebuffer to file
-    FILE* fp;
-    errno_t error = fopen_s(&fp, "binary.ppm", "wb");
-    std::cout << "error_t: " << error << std::endl;
-    if (!error) {
-        (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
-        for (auto i = 0; i < scene.height * scene.width; ++i) {
-            static unsigned char color[3];
-            color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, this->framebuffer[i].x), 0.6f));
-            color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, this->framebuffer[i].y), 0.6f));
-            color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, this->framebuffer[i].z), 0.6f));
-            fwrite(color, 1, 3, fp);
+ByteEncoder Renderer::OutputEncoder() const
+{
+    return srgbOutput ? ByteEncoder::SRGB() : ByteEncoder::Gamma(outputGamma);
+}
+
+void Renderer::SaveOutput(int width, int height) const
+{
+    if (!WriteImage(outputPath, width, height, framebuffer.data(), OutputEncoder(), pool.get())) {
+        std::cout << "\nfailed to write " << outputPath << "\n";
+    }
+}
+
+// checkpoint file: header, sampleCount[width * height], accumulation[width * height],
+// pixelStats[width * height] as pixelStatsRecordSize byte records
+struct CheckpointHeader
+{
+    char magic[4];
+    uint32_t version;
+    int32_t width, height;
+    int32_t passSpp, passesDone;
+    uint64_t seed;
+};
+static const char checkpointMagic[4] = { 'R', 'T', 'C', 'P' };
+static const uint32_t checkpointVersion = 3;
+
+// a PixelStats in the checkpoint: n, mean, m2 and converged as one byte, written field by field
+// so neither the struct's padding nor the representation of bool are part of the format
+static const size_t pixelStatsRecordSize = sizeof(uint32_t) + 2 * sizeof(float) + sizeof(uint8_t);
+
+static void packPixelStats(const PixelStats& stats, char* record)
+{
+    uint8_t converged = stats.converged ? 1 : 0;
+    std::memcpy(record, &stats.n, sizeof(uint32_t));
+    std::memcpy(record + 4, &stats.mean, sizeof(float));
+    std::memcpy(record + 8, &stats.m2, sizeof(float));
+    std::memcpy(record + 12, &converged, sizeof(uint8_t));
+}
+
+// false for a record no render could have written: a flag other than 0 or 1, or more
+// samples than the pixel got
+static bool unpackPixelStats(const char* record, uint32_t sampleCount, PixelStats& stats)
+{
+    uint8_t converged;
+    std::memcpy(&stats.n, record, sizeof(uint32_t));
+    std::memcpy(&stats.mean, record + 4, sizeof(float));
+    std::memcpy(&stats.m2, record + 8, sizeof(float));
+    std::memcpy(&converged, record + 12, sizeof(uint8_t));
+    stats.converged = converged == 1;
+    return converged <= 1 && stats.n <= sampleCount;
+}
+
+bool Renderer::SaveCheckpoint(const std::string& path, int width, int height, int passesDone) const
+{
+    CheckpointHeader header;
+    std::copy(checkpointMagic, checkpointMagic + 4, header.magic);
+    header.version = checkpointVersion;
+    header.width = width;
+    header.height = height;
+    header.passSpp = passSpp;
+    header.passesDone = passesDone;
+    header.seed = renderSeed;
+
+    // write next to the old checkpoint first, a crash while writing must not destroy it
+    std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(sampleCount.data()), sampleCount.size() * sizeof(uint32_t));
+        out.write(reinterpret_cast<const char*>(accumulation.data()), accumulation.size() * sizeof(Vector3f));
+        std::vector<char> records(pixelStats.size() * pixelStatsRecordSize);
+        for (size_t i = 0; i < pixelStats.size(); ++i) {
+            packPixelStats(pixelStats[i], &records[i * pixelStatsRecordSize]);
         }
-        fclose(fp);
+        out.write(records.data(), records.size());
+        if (!out) return false;
     }
+    return RenameReplacing(tmpPath, path);
 }
 
-void Renderer::Render(const Scene& scene)
+bool Renderer::LoadCheckpoint(const std::string& path, int width, int height, int& passesDone)
 {
-    framebuffer = std::vector<Vector3f>(scene.width * scene.height);
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
 
+    CheckpointHeader header;
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!in || !std::equal(checkpointMagic, checkpointMagic + 4, header.magic) || header.version != checkpointVersion) {
+        std::cout << "checkpoint " << path << " is not a valid checkpoint\n";
+        return false;
+    }
+    // later passes continue the random streams of the checkpoint, which only works for the same pass layout
+    if (header.width != width || header.height != height || header.passSpp != passSpp) {
+        std::cout << "checkpoint " << path << " was made with other render settings\n";
+        return false;
+    }
+
+    std::vector<uint32_t> counts(sampleCount.size());
+    std::vector<Vector3f> sums(accumulation.size());
+    std::vector<PixelStats> stats(pixelStats.size());
+    std::vector<char> records(stats.size() * pixelStatsRecordSize);
+    in.read(reinterpret_cast<char*>(counts.data()), counts.size() * sizeof(uint32_t));
+    in.read(reinterpret_cast<char*>(sums.data()), sums.size() * sizeof(Vector3f));
+    in.read(records.data(), records.size());
+    if (!in) {
+        std::cout << "checkpoint " << path << " is truncated\n";
+        return false;
+    }
+    for (size_t i = 0; i < stats.size(); ++i) {
+        if (!unpackPixelStats(&records[i * pixelStatsRecordSize], counts[i], stats[i])) {
+            std::cout << "checkpoint " << path << " has invalid statistics for pixel " << i << "\n";
+            return false;
+        }
+    }
+
+    sampleCount = std::move(counts);
+    accumulation = std::move(sums);
+    pixelStats = std::move(stats);
+    renderSeed = header.seed;
+    passesDone = header.passesDone;
+    return true;
+}
+
+void Renderer::SavePreview(const std::string& path, int width, int height) const
+{
+    std::vector<Vector3f> pixels((size_t)width * height);
+    for (size_t i = 0; i < accumulation.size(); ++i) {
+        pixels[i] = sampleCount[i] > 0 ? accumulation[i] / (float)sampleCount[i] : Vector3f(0);
+    }
+    WriteImage(path, width, height, pixels.data(), OutputEncoder(), pool.get());
+}
+
+void Renderer::RenderProgressive(const Scene& scene)
+{
     float scale = tan(deg2rad(scene.fov * 0.5));
     float imageAspectRatio = scene.width / (float)scene.height;
+    size_t pixelCount = (size_t)scene.width * scene.height;
+    accumulation.assign(pixelCount, Vector3f(0));
+    sampleCount.assign(pixelCount, 0);
+    pixelStats.assign(pixelCount, PixelStats());
+    BeginRender();
 
-    int m = 0;
-    std::cout << "SPP: " << spp << "\n";
-    for (uint32_t j = 0; j < scene.height; ++j) {
-        for (uint32_t i = 0; i < scene.width; ++i) {
-            float x = (2 * (i + 0.5) * scene.invWidth - 1) *
-                imageAspectRatio * scale;
-            float y = (1 - 2 * (j + 0.5) * scene.invHeight) * scale;
-
-            // ,-x, z1
-            Vector3f dir = Vector3f(-x, y, 1);
-            Ray primary(scene.eyePos, normalize(dir));
-
-            for (int k = 0; k < spp; k++) {
-                framebuffer[m] += scene.castRay(primary, 0) * invSpp;
+    if (!pool || pool->size() != threadCount) {
+        pool = std::make_unique<ThreadPool>(threadCount);
+    }
+
+    int samplesPerPass = std::max(1, passSpp);
+    passSpp = samplesPerPass;
+    int passCount = (spp + samplesPerPass - 1) / samplesPerPass;
+    int firstPass = 0;
+    if (resume && LoadCheckpoint(checkpointPath, scene.width, scene.height, firstPass)) {
+        std::cout << "resuming " << checkpointPath << " after pass " << firstPass << "\n";
+    }
+
+    std::cout << "SPP: " << passCount * samplesPerPass << " in " << passCount << " passes\n";
+
+    std::vector<Tile> tiles = MakeTiles(scene);
+    int tilesPerTask = TilesPerTask(samplesPerPass);
+    int taskCount = ((int)tiles.size() + tilesPerTask - 1) / tilesPerTask;
+    wavefronts.resize(std::max((size_t)pool->size(), wavefronts.size()));
+    PixelStats* stats = adaptive ? pixelStats.data() : nullptr;
+    for (int pass = firstPass; pass < passCount; ++pass) {
+        // every pass draws from its own streams, so resuming repeats no sample
+        uint64_t passSeed = renderSeed + (uint64_t)pass;
+        std::atomic<int> activePixels{ 0 };
+        pool->Run(taskCount,
+            [&](int taskIx, int workerIx) {
+                int first = taskIx * tilesPerTask;
+                int count = std::min(tilesPerTask, (int)tiles.size() - first);
+                RenderTiles(scene, scale, imageAspectRatio, &tiles[first], count, workerIx,
+                            samplesPerPass, passSeed, accumulation.data(), 1.f, stats);
+                int active = 0;
+                for (int t = first; t < first + count; ++t) {
+                    const Tile& tile = tiles[t];
+                    for (int j = tile.y0; j < tile.y1; ++j) {
+                        for (int i = tile.x0; i < tile.x1; ++i) {
+                            size_t pixelIx = (size_t)j * scene.width + i;
+                            if (stats) {
+                                if (stats[pixelIx].converged) continue;
+                                stats[pixelIx].converged = stats[pixelIx].n >= (uint32_t)adaptiveMinSpp
+                                    && stats[pixelIx].RelativeError() < adaptiveThreshold;
+                            }
+                            sampleCount[pixelIx] += samplesPerPass;
+                            active += stats && stats[pixelIx].converged ? 0 : 1;
+                        }
+                    }
+                }
+                activePixels += active;
+            });
+        UpdateProgress((pass + 1) / (float)passCount);
+
+        int passesDone = pass + 1;
+        if (previewInterval > 0 && passesDone % previewInterval == 0) {
+            SavePreview(previewPath, scene.width, scene.height);
+        }
+        if (checkpointInterval > 0 && passesDone % checkpointInterval == 0 && passesDone < passCount) {
+            if (!SaveCheckpoint(checkpointPath, scene.width, scene.height, passesDone)) {
+                std::cout << "\nfailed to write checkpoint " << checkpointPath << "\n";
             }
-            m++;
         }
-        float process = j / (float)scene.height;
-        UpdateProgress(process);
+        if (stats && activePixels == 0) {
+            passCount = passesDone;
+            break;
+        }
     }
     UpdateProgress(1.f);
+    EndRender();
 
-    // save framebuffer to file
-    FILE* fp = nullptr;
-    errno_t e = fopen_s(&fp, "binary.ppm", "wb");
-    if (!e) {
-        (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
-        for (auto i = 0; i < scene.height * scene.width; ++i) {
-            static unsigned char color[3];
-            color[0] = (unsigned char)(255 * clamp(0, 1, framebuffer[i].x));
-            color[1] = (unsigned char)(255 * clamp(0, 1, framebuffer[i].y));
-            color[2] = (unsigned char)(255 * clamp(0, 1, framebuffer[i].z));
-            fwrite(color, 1, 3, fp);
-        }
-        fclose(fp);
+    totalSamples = 0;
+    for (uint32_t count : sampleCount) {
+        totalSamples += count;
+    }
+    std::cout << "\nsamples: " << totalSamples << ", " << (double)totalSamples / pixelCount << " per pixel\n";
+
+    framebuffer.resize(pixelCount);
+    for (size_t i = 0; i < pixelCount; ++i) {
+        framebuffer[i] = sampleCount[i] > 0 ? accumulation[i] / (float)sampleCount[i] : Vector3f(0);
+    }
+    SaveOutput(scene.width, scene.height);
+    if (checkpointInterval > 0) {
+        // the finished state, spp can be raised later and the render resumed from here
+        SaveCheckpoint(checkpointPath, scene.width, scene.height, passCount);
     }
 }
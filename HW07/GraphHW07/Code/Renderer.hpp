@@ -1,7 +1,11 @@
 //
 // Created by goksu on 2/25/20.
 //
+#include "Image.hpp"
 #include "Scene.hpp"
+#include "ThreadPool.hpp"
+#include "Wavefront.hpp"
+#include <string>
 
 #pragma once
 struct hit_payload
@@ -12,6 +16,51 @@ struct hit_payload
     Object* hit_obj;
 };
 
+// camera rays are traced in packets of the widest SIMD width available
+#ifdef RT_AVX
+using PrimaryPacket = RayPacket8;
+#else
+using PrimaryPacket = RayPacket4;
+#endif
+
+// running mean and variance of a pixel's sample luminance (Welford)
+struct PixelStats
+{
+    uint32_t n = 0;
+    float mean = 0, m2 = 0;
+    bool converged = false;
+
+    void Add(float x)
+    {
+        ++n;
+        float delta = x - mean;
+        mean += delta / n;
+        m2 += delta * (x - mean);
+    }
+    // standard error of the mean relative to the mean
+    float RelativeError() const
+    {
+        if (n < 2) return std::numeric_limits<float>::infinity();
+        float standardError = std::sqrt(m2 / (n - 1) / n);
+        // dark pixels would never reach a relative target, judge them on an absolute one
+        return standardError / std::max(mean, 1e-2f);
+    }
+};
+
+// screen-space rectangle [x0, x1) x [y0, y1)
+struct Tile
+{
+    int x0, y0, x1, y1;
+};
+
+// direction of the camera ray through the centre of pixel (i, j)
+inline Vector3f cameraRayDirection(const Scene& scene, float scale, float imageAspectRatio, int i, int j)
+{
+    float x = (2 * (i + 0.5) * scene.invWidth - 1) * imageAspectRatio * scale;
+    float y = (1 - 2 * (j + 0.5) * scene.invHeight) * scale;
+    return normalize(Vector3f(-x, y, 1));
+}
+
 class Renderer
 {
 public:
@@ -19,14 +68,89 @@ public:
     Renderer() {
         invSpp = 1. / spp;
     }
-    void operator() (Scene const& scene, float const scale, float const imageAspectRatio, int const rowIx);
+    void operator() (Scene const& scene, float const scale, float const imageAspectRatio, Tile const& tile);
     void RenderMultipleThread(const Scene& scene);
+    // spp samples in passes of passSpp, with previews and checkpoints in between
+    void RenderProgressive(const Scene& scene);
 
     //std::vector<Vector3f> framebuffer;
     // change the spp value to change sample ammount
     float invSpp;
     int spp = 32;
-    int threadCount = 8;
+    int threadCount = (int)std::max(1u, std::thread::hardware_concurrency());
+    // edge length in pixels of the tiles handed to the worker threads
+    int tileSize = 16;
+    // every pixel draws from its own random stream derived from the render seed.
+    // with fixedSeed the seed is `seed` and renders are bit-reproducible for any threadCount.
+    bool fixedSeed = false;
+    uint64_t seed = 0;
     std::vector<Vector3f> framebuffer;
+    // where renders end up. .pfm and .exr keep the linear floats, other paths get an 8 bit PPM
+    std::string outputPath = "binary.ppm";
+    // 8 bit images: x^outputGamma, or the sRGB curve with srgbOutput
+    float outputGamma = 0.6f;
+    bool srgbOutput = false;
+    // Chrome trace-event JSON with the wall time of every render task per worker, written
+    // when a render finishes. empty turns the timing off. the hot path counters of a build
+    // with RT_PROFILE are printed after every render and added to the trace
+    std::string tracePath;
+
+    // MEGAKERNEL: each pixel's samples run castRay/castPath to the end, one after the other.
+    // WAVEFRONT: the paths of several tiles advance bounce by bounce in batches (castPath's estimator)
+    enum class Engine { MEGAKERNEL, WAVEFRONT };
+    Engine engine = Engine::MEGAKERNEL;
+    // wavefront only: about this many paths in flight per worker, tiles with more pixels times
+    // samples are rendered in several batches. bigger batches keep more rays of one kind
+    // together but give the pool fewer, longer tasks to balance
+    int wavefrontPaths = 1 << 14;
+
+    // progressive rendering: samples per pixel in one pass
+    int passSpp = 4;
+    // passes between two preview images / checkpoints, 0 turns them off
+    int previewInterval = 8;
+    int checkpointInterval = 16;
+    std::string previewPath = "preview.ppm";
+    std::string checkpointPath = "render.ckpt";
+    // continue from checkpointPath when it belongs to the same image size and passSpp
+    bool resume = false;
+    // progressive only: stop sampling a pixel once its relative error is below adaptiveThreshold.
+    // pixels get at least adaptiveMinSpp and at most spp samples
+    bool adaptive = false;
+    float adaptiveThreshold = 0.02f;
+    int adaptiveMinSpp = 16;
+    // samples spent by the last progressive render
+    uint64_t totalSamples = 0;
 private:
+    std::vector<Tile> MakeTiles(const Scene& scene) const;
+    // tiles rendered by one task: one for the megakernel, enough for about wavefrontPaths paths otherwise
+    int TilesPerTask(int samples) const;
+    // RenderTile over count tiles with the selected engine, workerIx picks the wavefront buffers
+    void RenderTiles(const Scene& scene, float scale, float imageAspectRatio, const Tile* tiles, int count, int workerIx,
+                     int samples, uint64_t passSeed, Vector3f* target, float weight, PixelStats* stats = nullptr);
+    void BeginRender();
+    // profile summary and trace of the render
+    void EndRender() const;
+    // add samples radiance samples per pixel of tile, each scaled by weight, to target
+    // with stats, converged pixels are skipped and every sample is added to the pixel's stats
+    void RenderTile(const Scene& scene, float scale, float imageAspectRatio, const Tile& tile,
+                    int samples, uint64_t passSeed, Vector3f* target, float weight, PixelStats* stats = nullptr);
+    bool SaveCheckpoint(const std::string& path, int width, int height, int passesDone) const;
+    bool LoadCheckpoint(const std::string& path, int width, int height, int& passesDone);
+    // accumulation divided by the sample counts, written like the final image
+    void SavePreview(const std::string& path, int width, int height) const;
+    ByteEncoder OutputEncoder() const;
+    // framebuffer to outputPath
+    void SaveOutput(int width, int height) const;
+
+    // progressive state: sum of all samples and number of samples per pixel
+    std::vector<Vector3f> accumulation;
+    std::vector<uint32_t> sampleCount;
+    std::vector<PixelStats> pixelStats;
+
+    uint64_t renderSeed = 0;
+
+    // kept alive between renders so threads are created once
+    std::unique_ptr<ThreadPool> pool;
+    // path queues of every worker, reused by all batches
+    std::vector<Wavefront> wavefronts;
 };
@@ -0,0 +1,71 @@
+//
+// Per-thread random streams for Monte Carlo sampling.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <thread>
+
+// PCG32 by M.E. O'Neill (pcg-random.org): 16 bytes of state and a handful of
+// integer ops per draw. Every (seed, stream) pair gives an independent sequence.
+class PCG32
+{
+public:
+    PCG32() { Seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+    PCG32(uint64_t initState, uint64_t initSeq) { Seed(initState, initSeq); }
+
+    void Seed(uint64_t initState, uint64_t initSeq)
+    {
+        state = 0u;
+        inc = (initSeq << 1u) | 1u;
+        NextUInt();
+        state += initState;
+        NextUInt();
+    }
+
+    uint32_t NextUInt()
+    {
+        uint64_t oldState = state;
+        state = oldState * 6364136223846793005ULL + inc;
+        uint32_t xorShifted = (uint32_t)(((oldState >> 18u) ^ oldState) >> 27u);
+        uint32_t rot = (uint32_t)(oldState >> 59u);
+        return (xorShifted >> rot) | (xorShifted << ((~rot + 1u) & 31));
+    }
+
+    // uniform in [0, 1)
+    float NextFloat()
+    {
+        return std::min(NextUInt() * 2.3283064365386963e-10f, 0x1.fffffep-1f);
+    }
+
+private:
+    uint64_t state, inc;
+};
+
+// splitmix64 finalizer, spreads nearby seeds (pixel indices, pass numbers) over the whole state space
+inline uint64_t MixSeed(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Every thread owns its generator, so sampling never touches shared state.
+// Threads that never call SeedThreadRng get a nondeterministic seed.
+inline PCG32& ThreadRng()
+{
+    thread_local PCG32 rng(MixSeed(std::random_device{}()), MixSeed(std::hash<std::thread::id>{}(std::this_thread::get_id())));
+    return rng;
+}
+
+// Restart the calling thread's generator on stream `stream` of `seed`. The renderer
+// does this per pixel, which makes the image independent of thread scheduling.
+inline void SeedThreadRng(uint64_t seed, uint64_t stream)
+{
+    ThreadRng().Seed(MixSeed(seed), stream);
+}
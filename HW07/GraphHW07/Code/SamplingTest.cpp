@@ -0,0 +1,87 @@
+//
+// Statistical check of MeshTriangle area sampling: triangles have to be picked in
+// proportion to their area, and points have to be uniform inside each triangle.
+//
+
+#include "Triangle.hpp"
+#include <cstdio>
+#include <vector>
+
+const float EPSILON = 0.00001;
+
+// chi-square statistic of observed counts against expected probabilities
+static double chiSquare(const std::vector<long>& counts, const std::vector<double>& probs, long n)
+{
+    double chi2 = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        double expected = probs[i] * n;
+        chi2 += (counts[i] - expected) * (counts[i] - expected) / expected;
+    }
+    return chi2;
+}
+
+int main()
+{
+    SeedThreadRng(2020, 0);
+
+    // triangles 1000 apart along x, so a sample's x tells which one it came from.
+    // areas span about three orders of magnitude.
+    const int triangleCount = 16;
+    const float spacing = 1000;
+    std::vector<Vector3f> verts;
+    for (int i = 0; i < triangleCount; ++i) {
+        float size = 0.1f * std::pow(1.6f, (float)i);
+        Vector3f v0(spacing * i, 0, 0);
+        verts.push_back(v0);
+        verts.push_back(v0 + Vector3f(size, 0, 0));
+        verts.push_back(v0 + Vector3f(size * 0.3f, size * (0.5f + 0.2f * (i % 3)), size * 0.1f * (i % 2)));
+    }
+    MeshTriangle mesh(verts, new Material(DIFFUSE, Vector3f(1)));
+
+    // the mesh keeps its triangles in BVH order, so expectations come from the input
+    std::vector<Triangle> input;
+    std::vector<double> triangleProbs;
+    for (int i = 0; i < triangleCount; ++i) {
+        input.emplace_back(verts[3 * i], verts[3 * i + 1], verts[3 * i + 2]);
+        triangleProbs.push_back(input.back().area / mesh.area);
+    }
+
+    // inside a triangle: the three corner sub-triangles of the midpoint subdivision
+    // and the middle one each cover a quarter
+    const long sampleCount = 2000000;
+    std::vector<long> triangleCounts(triangleCount, 0);
+    std::vector<long> quarterCounts(4, 0);
+    long outside = 0, badPdf = 0;
+    for (long n = 0; n < sampleCount; ++n) {
+        Intersection pos;
+        float pdf;
+        mesh.Sample(pos, pdf);
+
+        int k = std::min(triangleCount - 1, std::max(0, (int)(pos.coords.x / spacing)));
+        ++triangleCounts[k];
+        if (std::fabs(pdf * mesh.area - 1) > 1e-4) ++badPdf;
+
+        // barycentric coordinates of the sample in triangle k
+        const Triangle& tri = input[k];
+        Vector3f p = pos.coords - tri.v0;
+        float d00 = dotProduct(tri.e1, tri.e1), d01 = dotProduct(tri.e1, tri.e2), d11 = dotProduct(tri.e2, tri.e2);
+        float d20 = dotProduct(p, tri.e1), d21 = dotProduct(p, tri.e2);
+        float denom = d00 * d11 - d01 * d01;
+        float b1 = (d11 * d20 - d01 * d21) / denom;
+        float b2 = (d00 * d21 - d01 * d20) / denom;
+        float b0 = 1 - b1 - b2;
+        if (b0 < -1e-3f || b1 < -1e-3f || b2 < -1e-3f) ++outside;
+        ++quarterCounts[b0 > 0.5f ? 0 : b1 > 0.5f ? 1 : b2 > 0.5f ? 2 : 3];
+    }
+
+    // critical values at p = 0.001 for 15 and 3 degrees of freedom
+    double triangleChi2 = chiSquare(triangleCounts, triangleProbs, sampleCount);
+    double quarterChi2 = chiSquare(quarterCounts, std::vector<double>(4, 0.25), sampleCount);
+    bool ok = triangleChi2 < 37.70 && quarterChi2 < 16.27 && outside == 0 && badPdf == 0;
+
+    printf("triangle selection chi2 %.2f (limit 37.70)\n", triangleChi2);
+    printf("in-triangle uniformity chi2 %.2f (limit 16.27)\n", quarterChi2);
+    printf("samples outside their triangle %ld, wrong pdf %ld\n", outside, badPdf);
+    printf(ok ? "PASSED\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -4,11 +4,51 @@
 
 #include "Scene.hpp"
 #include <cassert>
+#include <unordered_map>
 
 
 void Scene::buildBVH() {
     printf(" - Generating scene BVH...\n\n");
-    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    this->bvh = std::make_unique<BVHAccel>(objects, 1, BVHAccel::SplitMethod::SAH, 18, bvhLayout);
+    buildEmitterTable();
+
+    // materials are compiled here so their constants are fixed once per build. they are told
+    // apart by address, not by m->compiled, which may still point at a freed kernel of the
+    // last build whose memory a kernel of this build reuses
+    compiledMaterials.clear();
+    std::unordered_map<Material*, CompiledMaterial*> compiledFor;
+    for (Object* object : objects) {
+        Material* m = object->getMaterial();
+        CompiledMaterial*& compiled = compiledFor[m];
+        if (!compiled) {
+            compiledMaterials.push_back(std::make_unique<CompiledMaterial>(*m));
+            compiled = compiledMaterials.back().get();
+        }
+        m->compiled = compiled;
+    }
+}
+
+void Scene::updateBVH() {
+    if (!bvh) {
+        buildBVH();
+        return;
+    }
+    bvh->Update();
+    // emitter areas may have changed
+    buildEmitterTable();
+}
+
+void Scene::buildEmitterTable() {
+    // lights are picked in proportion to their power, so bright emitters get most of the shadow rays
+    emitters.clear();
+    std::vector<float> weights;
+    for (Object* object : objects) {
+        if (object->hasEmit()) {
+            emitters.push_back(object);
+            weights.push_back(object->getArea() * luminance(object->getMaterial()->getEmission()));
+        }
+    }
+    emitterTable = AliasTable(weights);
 }
 
 Intersection Scene::intersect(const Ray& ray) const
@@ -16,27 +56,34 @@ Intersection Scene::intersect(const Ray& ray) const
     return this->bvh->Intersect(ray);
 }
 
+void Scene::intersect(const RayPacket4& packet, Intersection* hits) const
+{
+    this->bvh->Intersect4(packet, hits);
+}
+
+void Scene::intersect(const RayPacket8& packet, Intersection* hits) const
+{
+    this->bvh->Intersect8(packet, hits);
+}
+
+bool Scene::intersectP(const Ray& ray, float tMax) const
+{
+    return this->bvh->IntersectP(ray, tMax);
+}
+
 void Scene::sampleLight(Intersection& pos, float& pdf) const
 {
-    // 发光面积总合, 这里不是light而是object
-    float emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()) {
-            emit_area_sum += objects[k]->getArea();
-        }
-    }
-    float p = get_random_float() * emit_area_sum;
-    emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()) {
-            emit_area_sum += objects[k]->getArea();
-            if (p <= emit_area_sum) {
-                // model(triangle set) random a triangle though bvh sample.
-                objects[k]->Sample(pos, pdf);
-                break;
-            }
-        }
+    RT_PROFILE_COUNT(LightSamples, 1);
+    // 这里不是light而是object
+    if (emitterTable.empty()) {
+        pdf = 0;
+        return;
     }
+    int k = emitterTable.Sample(get_random_float());
+    // model(triangle set) random a triangle though bvh sample.
+    emitters[k]->Sample(pos, pdf);
+    // Sample gives the pdf over the emitter's own area, times the chance of picking it
+    pdf *= emitterTable.Pmf(k);
 }
 
 bool Scene::trace(
@@ -62,65 +109,108 @@ bool Scene::trace(
 // Implementation of Path Tracing
 Vector3f Scene::castRay(const Ray& ray, int depth, bool onlyDirect) const
 {
-    float pdfL;
-    Vector3f directL(0, 0, 0);
-    Vector3f indirectL(0, 0, 0);
-    Intersection interP, sampleL;
+    return castRay(ray, bvh->Intersect(ray), depth, onlyDirect);
+}
 
-    interP = bvh->Intersect(ray);
+// power heuristic with beta = 2, weight of the strategy with pdf fPdf
+static float powerHeuristic(float fPdf, float gPdf)
+{
+    float f2 = fPdf * fPdf, g2 = gPdf * gPdf;
+    return f2 + g2 > 0 ? f2 / (f2 + g2) : 0;
+}
 
-    // not hit bvh
-    if (!interP.happened) {
-        return backgroundColor;
-    }
+float Scene::lightPdf(const Intersection& hit) const
+{
+    // emitter chosen with area * luminance / total, then a uniform point on it
+    if (emitterTable.empty()) return 0;
+    return (float)(luminance(hit.m->getEmission()) / emitterTable.Total());
+}
 
-    // primary hit light
-    if (interP.obj->hasEmit()) {
-        return interP.m->getEmission();
+// light sampled at a non-emissive hit point, shared by both integrators
+Vector3f Scene::directLight(const Intersection& interP, const BSDFFrame& frame, bool mis) const
+{
+    Vector3f toLight, directL;
+    float distance;
+    // shadow ray只需知道光源前有没有遮挡, 不需要最近交点.
+    if (!sampleDirectLight(interP, frame, mis, toLight, distance, directL)
+        || bvh->IntersectP(Ray(interP.coords, toLight), distance - EPSILON * 20)) {
+        return Vector3f(0, 0, 0);
     }
+    return directL;
+}
+
+bool Scene::sampleDirectLight(const Intersection& interP, const BSDFFrame& frame, bool mis,
+                              Vector3f& toLight, float& distance, Vector3f& directL) const
+{
+    float pdfL;
+    Intersection sampleL;
 
     // sample in the lights
     sampleLight(sampleL, pdfL);
+    if (pdfL <= 0) {
+        return false;
+    }
 
-    // check light path is occlusion or not
     Vector3f woL = normalize(sampleL.coords - interP.coords);
-    Ray rayP2L(interP.coords, woL);
-
-    // take attention to ray hit origin inter point
-    Intersection interP2L = bvh->Intersect(rayP2L);
     Vector3f vectorP2L = sampleL.coords - interP.coords;
-    float distance = sqrt(dotProduct(vectorP2L, vectorP2L));
+    float cosphi2 = dotProduct(woL, sampleL.normal);
 
-    // not occlusion and light isn't in object back face
     // if (dotProduct(woL, interP.normal) >= 0 && fabs(distance - interP2L.distance) < EPSILON*20) {
-    // 直接光被遮挡
     // 就不用上面的语句了, 因为有折射的材质是允许光来自"另一个面", 折射使用BTDF
-    if (fabs(distance - interP2L.distance) < EPSILON * 20) {
-        float cosphi2 = dotProduct(rayP2L.direction, sampleL.normal);
+    // 光源背面本来就会被三角形求交剔除, 所以只有正对的光源可见
+    if (cosphi2 >= 0) {
+        return false;
+    }
+    cosphi2 = -cosphi2;
+    toLight = woL;
+    distance = sqrt(dotProduct(vectorP2L, vectorP2L));
 
-        if (cosphi2 < 0) {
-            cosphi2 = -cosphi2;
-        }
+    // 光贡献的radiance: f(p, wi->wo)L(wi)cos(phi)cos(phi2)dA / (L_hit - p) ^ 2 / pdf
+    directL = interP.m->compiled->eval(frame, woL)
+        * sampleL.m->m_emission
+        * dotProduct(woL, interP.normal)
+        * cosphi2
+        /// std::max(EPSILON, dotProduct(vectorP2L, vectorP2L)) 这种方式仍然可能导致结果过大
+        / dotProduct(vectorP2L, vectorP2L)
+        / pdfL;
+
+    // the BSDF sampled bounce can hit the same light, MIS splits the contribution between both
+    if (mis) {
+        float pdfLightSolidAngle = pdfL * dotProduct(vectorP2L, vectorP2L) / cosphi2;
+        float pdfBsdf = interP.m->compiled->pdf(frame, woL);
+        directL = directL * powerHeuristic(pdfLightSolidAngle, pdfBsdf);
+    }
+    return true;
+}
 
-        // 光贡献的radiance: f(p, wi->wo)L(wi)cos(phi)cos(phi2)dA / (L_hit - p) ^ 2 / pdf
-        directL = interP.m->eval(ray.direction, rayP2L.direction, interP.normal)
-            * sampleL.m->m_emission
-            * dotProduct(rayP2L.direction, interP.normal)
-            * cosphi2
-            /// std::max(EPSILON, dotProduct(vectorP2L, vectorP2L)) 这种方式仍然可能导致结果过大
-            / dotProduct(vectorP2L, vectorP2L)
-            / pdfL;
+float Scene::bsdfLightWeight(const Vector3f& wo, float pdfBsdf, const Intersection& lightHit) const
+{
+    float cosLight = -dotProduct(wo, lightHit.normal);
+    float pdfLight = lightPdf(lightHit) * lightHit.distance * lightHit.distance / std::max(cosLight, EPSILON);
+    return powerHeuristic(pdfBsdf, pdfLight);
+}
 
-        //if (directL.norm() > sampleL.m->m_emission.norm()) {
-        //    std::cout << " directL " << directL.norm() << " more than light radiance\n";
-        //    directL = sampleL.m->m_emission;
-        //}
+Vector3f Scene::castRay(const Ray& ray, const Intersection& hit, int depth, bool onlyDirect) const
+{
+    Vector3f directL(0, 0, 0);
+    Vector3f indirectL(0, 0, 0);
+    const Intersection& interP = hit;
 
-        //if (directL.x < 0 || directL.y < 0 || directL.z < 0) {
-        //    std::cout << "directL is negative\n";
-        //}
+    // not hit bvh
+    if (!interP.happened) {
+        return backgroundColor;
     }
 
+    // primary hit light
+    if (interP.obj->hasEmit()) {
+        return interP.m->getEmission();
+    }
+
+    RT_PROFILE_COUNT(PathVertices, 1);
+    const CompiledMaterial& bsdf = *interP.m->compiled;
+    BSDFFrame frame = bsdf.frame(ray.direction, interP.normal);
+    directL = directLight(interP, frame, !onlyDirect);
+
     // 俄罗斯轮盘发射反射光
     // generate p in [0: 1]. if p < possible then reflect.
     float p = get_random_float();
@@ -128,7 +218,7 @@ Vector3f Scene::castRay(const Ray& ray, int depth, bool onlyDirect) const
     // 使用onlyDirect方便忽略间接光, 通过直接光来初步判断结果是否正确
     if (!onlyDirect && p < RussianRoulette) {
         // 给出的wo可能指向表面的背面, wo dot N < 0
-        Vector3f wo = interP.m->sample(ray.direction, interP.normal);
+        Vector3f wo = bsdf.sample(frame);
 
         if (dotProduct(wo, interP.normal) > 0) {
             Ray rayP2Wo(interP.coords, wo);
@@ -137,17 +227,99 @@ Vector3f Scene::castRay(const Ray& ray, int depth, bool onlyDirect) const
 
             if (interP2Wo.happened && !interP2Wo.m->hasEmission()) {
                 // f(p, wi->wo)L(wi)cos(phi)dw / possible / pdf
-                indirectL = interP.m->eval(ray.direction, rayP2Wo.direction, interP.normal)
+                indirectL = bsdf.eval(frame, rayP2Wo.direction)
                     * castRay(rayP2Wo, ++depth, onlyDirect)
                     * -dotProduct(-rayP2Wo.direction, interP.normal)
                     / RussianRoulette
-                    / interP.m->pdf(ray.direction, wo, interP.normal);
+                    / bsdf.pdf(frame, wo);
 
                 //if (indirectL.x < 0 || indirectL.y < 0 || indirectL.z < 0) {
                 //    std::cout << "indirectL is negative\n";
                 //}
             }
+            else if (interP2Wo.happened) {
+                // 击中光源: BSDF采样得到的直接光, 用MIS权重和光源采样的结果合并
+                float pdfBsdf = bsdf.pdf(frame, wo);
+                float cosLight = -dotProduct(wo, interP2Wo.normal);
+                float pdfLight = lightPdf(interP2Wo) * interP2Wo.distance * interP2Wo.distance / std::max(cosLight, EPSILON);
+                indirectL = bsdf.eval(frame, wo)
+                    * interP2Wo.m->getEmission()
+                    * dotProduct(wo, interP.normal)
+                    / RussianRoulette
+                    / pdfBsdf
+                    * powerHeuristic(pdfBsdf, pdfLight);
+            }
         }
     }
     return onlyDirect ? directL : directL + indirectL;
-}
\ No newline at end of file
+}
+
+Vector3f Scene::castPath(const Ray& ray, const Intersection& hit, bool onlyDirect) const
+{
+    // same estimator as castRay: bounces that reach a light add their MIS weighted emission
+    // and end the path, bounces that leave the scene add nothing
+    if (!hit.happened) {
+        return backgroundColor;
+    }
+    if (hit.obj->hasEmit()) {
+        return hit.m->getEmission();
+    }
+
+    Vector3f L(0, 0, 0);
+    Vector3f throughput(1, 1, 1);
+    Ray pathRay = ray;
+    Intersection interP = hit;
+
+    for (int depth = 0; ; ++depth) {
+        // without a further bounce, light sampling is the only strategy and gets full weight
+        RT_PROFILE_COUNT(PathVertices, 1);
+        bool lastBounce = onlyDirect || (pathMaxDepth >= 0 && depth >= pathMaxDepth);
+        const CompiledMaterial& bsdf = *interP.m->compiled;
+        BSDFFrame frame = bsdf.frame(pathRay.direction, interP.normal);
+        L += throughput * directLight(interP, frame, !lastBounce);
+
+        if (lastBounce) {
+            break;
+        }
+
+        // 俄罗斯轮盘赌, rrStartDepth之前的弹射总是继续
+        float survive = 1.f;
+        if (depth >= rrStartDepth) {
+            if (get_random_float() >= RussianRoulette) break;
+            survive = RussianRoulette;
+        }
+
+        Vector3f wo = bsdf.sample(frame);
+        float cosTheta = dotProduct(wo, interP.normal);
+        if (cosTheta <= 0) break;
+
+        Ray nextRay(interP.coords, wo);
+        Intersection nextHit = bvh->Intersect(nextRay);
+        if (!nextHit.happened) break;
+
+        float pdfBsdf = bsdf.pdf(frame, wo);
+        throughput = throughput
+            * bsdf.eval(frame, wo)
+            * cosTheta
+            / survive
+            / pdfBsdf;
+
+        if (nextHit.m->hasEmission()) {
+            // the bounce found a light: its share under MIS, then the path ends like in castRay
+            L += throughput * nextHit.m->getEmission() * bsdfLightWeight(wo, pdfBsdf, nextHit);
+            break;
+        }
+
+        pathRay = nextRay;
+        interP = nextHit;
+    }
+    return L;
+}
+
+Vector3f Scene::radiance(const Ray& ray, const Intersection& hit) const
+{
+    if (integrator == Integrator::ITERATIVE) {
+        return castPath(ray, hit);
+    }
+    return castRay(ray, hit, 0);
+}
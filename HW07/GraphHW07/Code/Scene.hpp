@@ -10,6 +10,8 @@
 #include "Light.hpp"
 #include "AreaLight.hpp"
 #include "BVH.hpp"
+#include "AliasTable.hpp"
+#include "CompiledMaterial.hpp"
 #include "Ray.hpp"
 
 
@@ -27,6 +29,15 @@ public:
     int maxDepth = 1;
     // 俄罗斯轮盘赌
     float RussianRoulette = 0.8;
+    // node layout of the scene level BVH
+    BVHAccel::Layout bvhLayout = BVHAccel::Layout::BINARY;
+    // RECURSIVE: castRay, ITERATIVE: castPath. both estimate the same radiance
+    enum class Integrator { RECURSIVE, ITERATIVE };
+    Integrator integrator = Integrator::ITERATIVE;
+    // castPath only: most indirect bounces per path (-1: no limit, only Russian roulette ends paths)
+    int pathMaxDepth = -1;
+    // castPath only: bounces before this depth always continue
+    int rrStartDepth = 0;
 
     Scene() : width(1280), height(960), invWidth(1. / width), invHeight(1. / height), eyePos(Vector3f(0))
     {}
@@ -40,9 +51,33 @@ public:
     const std::vector<Object*>& get_objects() const { return objects; }
     const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
     Intersection intersect(const Ray& ray) const;
-    BVHAccel *bvh;
+    // closest hits of a packet of camera rays
+    void intersect(const RayPacket4& packet, Intersection* hits) const;
+    void intersect(const RayPacket8& packet, Intersection* hits) const;
+    // any hit closer than tMax, for shadow rays
+    bool intersectP(const Ray& ray, float tMax) const;
+    std::unique_ptr<BVHAccel> bvh;
     void buildBVH();
+    // after objects were moved or deformed (their own BVHs already updated): refit the scene BVH,
+    // rebuilding it only when it got much worse, and redo the light selection table
+    void updateBVH();
     Vector3f castRay(const Ray &ray, int depth, bool onlyDirect=false) const;
+    // castRay for a ray whose first hit is already known
+    Vector3f castRay(const Ray &ray, const Intersection& hit, int depth, bool onlyDirect=false) const;
+    // path tracing with a throughput loop instead of recursion
+    Vector3f castPath(const Ray &ray, const Intersection& hit, bool onlyDirect=false) const;
+    // radiance along a camera ray with the selected integrator
+    Vector3f radiance(const Ray &ray, const Intersection& hit) const;
+    // light sampled radiance at interP, MIS weighted against BSDF sampling when mis is set
+    Vector3f directLight(const Intersection& interP, const BSDFFrame& frame, bool mis) const;
+    // directLight without the shadow ray: the direction and distance to a sampled light point and the
+    // radiance it adds if nothing is in between. false when the sample cannot contribute
+    bool sampleDirectLight(const Intersection& interP, const BSDFFrame& frame, bool mis,
+                           Vector3f& toLight, float& distance, Vector3f& directL) const;
+    // MIS weight of a light reached by a BSDF sampled bounce along wo, against light sampling
+    float bsdfLightWeight(const Vector3f& wo, float pdfBsdf, const Intersection& lightHit) const;
+    // area density with which sampleLight picks the point hit on an emitter
+    float lightPdf(const Intersection& hit) const;
     void sampleLight(Intersection &pos, float &pdf) const;
     bool trace(const Ray &ray, const std::vector<Object*> &objects, float &tNear, uint32_t &index, Object **hitObject);
     std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight &light, const Vector3f &hitPoint, const Vector3f &N,
@@ -51,8 +86,15 @@ public:
                                                    const Vector3f &dir, float specularExponent);
 
     // creating the scene (adding objects and lights)
+    // the scene BVH is the top level over these; Instances share a prototype's BVH as the bottom level
     std::vector<Object* > objects;
     std::vector<std::unique_ptr<Light> > lights;
+    // emissive objects and their selection table (weight: area * emitted luminance), built in buildBVH
+    std::vector<Object* > emitters;
+    AliasTable emitterTable;
+    void buildEmitterTable();
+    // one compiled kernel per distinct material of objects
+    std::vector<std::unique_ptr<CompiledMaterial> > compiledMaterials;
 
     // Compute reflection direction
     Vector3f reflect(const Vector3f &I, const Vector3f &N) const
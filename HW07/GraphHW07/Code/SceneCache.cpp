@@ -0,0 +1,234 @@
+//
+// Mesh cache files, see SceneCache.hpp. Layout of a file, all little endian:
+//   CacheHeader
+//   sections at 32 byte aligned offsets: vertex positions, normals and uvs, corner indices,
+//   material indices, source indices, BVH nodes, BVH node areas
+//
+
+#include "SceneCache.hpp"
+#include "Sampler.hpp"
+#include "TriangleBuffer.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+
+uint64_t HashBytes(const unsigned char* data, size_t size, uint64_t hash)
+{
+    // one 8 byte word per step, a multi-million triangle OBJ is hashed on every start. each
+    // word goes through the splitmix64 finalizer with the hash so far: a plain multiply would
+    // only carry changes upwards and the high bytes of a word would never reach the low bits
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        hash = MixSeed(hash ^ word);
+    }
+    if (i < size) {
+        uint64_t word = 0;
+        std::memcpy(&word, data + i, size - i);
+        hash = MixSeed(hash ^ word);
+    }
+    return MixSeed(hash ^ size);
+}
+
+// bump when the file layout or anything stored in it changes
+static const uint32_t kCacheVersion = 2;
+static const char kCacheMagic[8] = { 'R', 'T', 'M', 'E', 'S', 'H', 0, 0 };
+static const size_t kSectionAlignment = 32;
+
+struct CacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t triangleCount;
+    uint64_t key;
+    uint32_t nodeCount;
+    uint32_t vertexCount;
+    uint32_t normalCount;     // 0 or vertexCount, as uvCount
+    uint32_t uvCount;
+    float bounds[6];          // mesh bounds, min then max
+    uint64_t fileSize;        // a truncated file is rejected before any section is read
+};
+static_assert(std::is_trivially_copyable<LinearBVHNode>::value, "nodes are stored as raw bytes");
+static_assert(sizeof(Vector3f) == 3 * sizeof(float) && sizeof(Vector2f) == 2 * sizeof(float),
+              "vertices are stored as raw floats");
+
+uint64_t MeshCacheKey(const std::string& objPath, int maxPrimsInNode, int bucketSize)
+{
+    MappedFile obj(objPath);
+    if (!obj.data()) return 0;
+    uint64_t hash = HashBytes(obj.data(), obj.size());
+    // the tree depends on how it was built as much as on the triangles
+    const int64_t parameters[4] = { (int64_t)obj.size(), kCacheVersion, maxPrimsInNode, bucketSize };
+    hash = HashBytes(reinterpret_cast<const unsigned char*>(parameters), sizeof(parameters), hash);
+    return hash ? hash : 1;
+}
+
+std::string MeshCachePath(const std::string& objPath)
+{
+    return objPath + ".rtcache";
+}
+
+static size_t alignSection(size_t offset)
+{
+    return (offset + kSectionAlignment - 1) / kSectionAlignment * kSectionAlignment;
+}
+
+// byte sizes of the sections in file order
+static std::vector<size_t> sectionSizes(const CacheHeader& header)
+{
+    size_t triangleCount = header.triangleCount, nodeCount = header.nodeCount;
+    std::vector<size_t> sizes;
+    sizes.push_back(header.vertexCount * sizeof(Vector3f));
+    sizes.push_back(header.normalCount * sizeof(Vector3f));
+    sizes.push_back(header.uvCount * sizeof(Vector2f));
+    sizes.push_back(3 * triangleCount * sizeof(uint32_t));
+    sizes.push_back(triangleCount * sizeof(uint16_t));
+    sizes.push_back(triangleCount * sizeof(int));
+    sizes.push_back(nodeCount * sizeof(LinearBVHNode));
+    sizes.push_back(nodeCount * sizeof(float));
+    return sizes;
+}
+
+bool LoadMeshCache(const std::string& path, uint64_t key, int maxPrimsInNode, TriangleBuffer& triangles,
+                   Bounds3& bounds, std::vector<LinearBVHNode>& nodes, std::vector<float>& nodeAreas)
+{
+    MappedFile file(path);
+    if (!file.data() || file.size() < sizeof(CacheHeader)) return false;
+    CacheHeader header;
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.magic, kCacheMagic, sizeof(kCacheMagic)) != 0 || header.version != kCacheVersion
+        || header.key != key || header.fileSize != file.size()
+        || (header.normalCount != 0 && header.normalCount != header.vertexCount)
+        || (header.uvCount != 0 && header.uvCount != header.vertexCount)) {
+        return false;
+    }
+
+    std::vector<size_t> sizes = sectionSizes(header);
+    std::vector<const unsigned char*> sections;
+    size_t offset = sizeof(CacheHeader);
+    for (size_t size : sizes) {
+        offset = alignSection(offset);
+        if (offset + size > file.size()) return false;
+        sections.push_back(file.data() + offset);
+        offset += size;
+    }
+
+    size_t n = header.triangleCount;
+    int section = 0;
+    // sections are aligned for their element type, the mapping starts on a page
+    const Vector3f* positions = reinterpret_cast<const Vector3f*>(sections[section++]);
+    triangles.positions.assign(positions, positions + header.vertexCount);
+    const Vector3f* normals = reinterpret_cast<const Vector3f*>(sections[section++]);
+    triangles.normals.assign(normals, normals + header.normalCount);
+    const Vector2f* uvs = reinterpret_cast<const Vector2f*>(sections[section++]);
+    triangles.uvs.assign(uvs, uvs + header.uvCount);
+    const uint32_t* indices = reinterpret_cast<const uint32_t*>(sections[section++]);
+    triangles.Indices().assign(indices, indices + 3 * n);
+    const uint16_t* materials = reinterpret_cast<const uint16_t*>(sections[section++]);
+    triangles.MaterialIndices().assign(materials, materials + n);
+    const int* sources = reinterpret_cast<const int*>(sections[section++]);
+    triangles.SourceIndices().assign(sources, sources + n);
+    const LinearBVHNode* savedNodes = reinterpret_cast<const LinearBVHNode*>(sections[section++]);
+    nodes.assign(savedNodes, savedNodes + header.nodeCount);
+    const float* areas = reinterpret_cast<const float*>(sections[section++]);
+    nodeAreas.assign(areas, areas + header.nodeCount);
+
+    // indices that would be followed out of the arrays: the file is damaged, leave everything empty
+    bool valid = true;
+    for (uint32_t index : triangles.Indices()) {
+        valid &= index < header.vertexCount;
+    }
+    for (uint16_t material : triangles.MaterialIndices()) {
+        valid &= material < triangles.materials.size();
+    }
+    // children come after their parent, the first one right after it, so the tree has no
+    // cycles. no deeper than the traversal stack (64 entries) of BVHAccel
+    std::vector<int> depth(nodes.size(), 1);
+    for (size_t i = 0; i < nodes.size() && valid; ++i) {
+        const LinearBVHNode& node = nodes[i];
+        if (node.nPrimitives > 0) {
+            valid &= node.nPrimitives <= maxPrimsInNode && node.primitivesOffset >= 0
+                && node.primitivesOffset + (size_t)node.nPrimitives <= n;
+        }
+        else {
+            valid &= i + 1 < nodes.size() && node.secondChildOffset > 0 && (size_t)node.secondChildOffset > i + 1
+                && (size_t)node.secondChildOffset < nodes.size() && node.axis < 3 && depth[i] < 64;
+            if (valid) {
+                depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+                depth[node.secondChildOffset] = std::max(depth[node.secondChildOffset], depth[i] + 1);
+            }
+        }
+    }
+    if (!valid) {
+        triangles.positions.clear();
+        triangles.normals.clear();
+        triangles.uvs.clear();
+        triangles.Indices().clear();
+        triangles.MaterialIndices().clear();
+        triangles.SourceIndices().clear();
+        nodes.clear();
+        nodeAreas.clear();
+        return false;
+    }
+    bounds = Bounds3(Vector3f(header.bounds[0], header.bounds[1], header.bounds[2]),
+                     Vector3f(header.bounds[3], header.bounds[4], header.bounds[5]));
+    return true;
+}
+
+bool SaveMeshCache(const std::string& path, uint64_t key, const TriangleBuffer& triangles, const Bounds3& bounds,
+                   const BVHAccel& bvh)
+{
+    size_t n = triangles.size();
+
+    std::vector<const void*> data;
+    data.push_back(triangles.positions.data());
+    data.push_back(triangles.normals.data());
+    data.push_back(triangles.uvs.data());
+    data.push_back(triangles.Indices().data());
+    data.push_back(triangles.MaterialIndices().data());
+    data.push_back(triangles.SourceIndices().data());
+    data.push_back(bvh.nodes.data());
+    data.push_back(bvh.nodeAreas.data());
+    CacheHeader header = {};
+    std::memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+    header.version = kCacheVersion;
+    header.triangleCount = (uint32_t)n;
+    header.key = key;
+    header.nodeCount = (uint32_t)bvh.nodes.size();
+    header.vertexCount = (uint32_t)triangles.positions.size();
+    header.normalCount = (uint32_t)triangles.normals.size();
+    header.uvCount = (uint32_t)triangles.uvs.size();
+    const float corners[6] = { bounds.pMin.x, bounds.pMin.y, bounds.pMin.z, bounds.pMax.x, bounds.pMax.y, bounds.pMax.z };
+    std::memcpy(header.bounds, corners, sizeof(corners));
+    std::vector<size_t> sizes = sectionSizes(header);
+    size_t offset = sizeof(CacheHeader);
+    for (size_t size : sizes) {
+        offset = alignSection(offset) + size;
+    }
+    header.fileSize = offset;
+
+    // written under another name and renamed, so no run ever maps half a file
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        offset = sizeof(CacheHeader);
+        const char zeros[kSectionAlignment] = {};
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            size_t aligned = alignSection(offset);
+            out.write(zeros, aligned - offset);
+            out.write(static_cast<const char*>(data[i]), sizes[i]);
+            offset = aligned + sizes[i];
+        }
+        if (!out) {
+            out.close();
+            std::remove(temporary.c_str());
+            return false;
+        }
+    }
+    // a crash never leaves the cache missing or half written, it is the old or the new one
+    return RenameReplacing(temporary, path);
+}
@@ -0,0 +1,33 @@
+//
+// Binary cache of loaded meshes: the triangle buffer in BVH leaf order and the flattened BVH
+// nodes, written next to the OBJ (file.obj.rtcache) after it has been parsed and built once.
+// Later runs map the cache file and copy the arrays out instead of parsing and building.
+// A cache belongs to a 64 bit hash and the size of the OBJ's bytes and to the format version and
+// build parameters; anything that does not match is ignored and written again.
+//
+
+#pragma once
+
+#include "BVH.hpp"
+#include "MappedFile.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class TriangleBuffer;
+
+// 64 bit hash over 8 byte words, each mixed in with splitmix64
+uint64_t HashBytes(const unsigned char* data, size_t size, uint64_t hash = 14695981039346656037ull);
+
+// key of the cache for an OBJ and the tree parameters MeshTriangle builds with, 0 when the OBJ is unreadable
+uint64_t MeshCacheKey(const std::string& objPath, int maxPrimsInNode, int bucketSize);
+std::string MeshCachePath(const std::string& objPath);
+
+// triangles (in leaf order), mesh bounds and BVH node arrays of a cached mesh, false when the
+// cache is missing, damaged or belongs to another key. triangles must have its materials set,
+// leaves with more than maxPrimsInNode triangles count as damage
+bool LoadMeshCache(const std::string& path, uint64_t key, int maxPrimsInNode, TriangleBuffer& triangles,
+                   Bounds3& bounds, std::vector<LinearBVHNode>& nodes, std::vector<float>& nodeAreas);
+bool SaveMeshCache(const std::string& path, uint64_t key, const TriangleBuffer& triangles, const Bounds3& bounds,
+                   const BVHAccel& bvh);
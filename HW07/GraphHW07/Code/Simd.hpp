@@ -0,0 +1,184 @@
+//
+// Minimal 4/8-wide float vectors for packet traversal.
+// SSE backs vfloat4, AVX backs vfloat8, plain loops are the fallback elsewhere.
+//
+
+#pragma once
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RT_SSE 1
+#endif
+#if defined(__AVX__)
+#define RT_AVX 1
+#endif
+
+#if defined(RT_SSE) || defined(RT_AVX)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+
+// scalar fallback with the same interface as the intrinsic versions
+template <int N>
+struct vfloat_scalar;
+
+template <int N>
+struct vmask_scalar
+{
+    bool m[N];
+    int bits() const
+    {
+        int b = 0;
+        for (int i = 0; i < N; ++i) b |= m[i] ? 1 << i : 0;
+        return b;
+    }
+    friend vmask_scalar operator&(const vmask_scalar& a, const vmask_scalar& b)
+    {
+        vmask_scalar r;
+        for (int i = 0; i < N; ++i) r.m[i] = a.m[i] && b.m[i];
+        return r;
+    }
+    friend vmask_scalar operator|(const vmask_scalar& a, const vmask_scalar& b)
+    {
+        vmask_scalar r;
+        for (int i = 0; i < N; ++i) r.m[i] = a.m[i] || b.m[i];
+        return r;
+    }
+};
+
+template <int N>
+struct vfloat_scalar
+{
+    static constexpr int size = N;
+    using mask = vmask_scalar<N>;
+    float v[N];
+
+    vfloat_scalar() = default;
+    vfloat_scalar(float s) { for (int i = 0; i < N; ++i) v[i] = s; }
+    static vfloat_scalar load(const float* p)
+    {
+        vfloat_scalar r;
+        for (int i = 0; i < N; ++i) r.v[i] = p[i];
+        return r;
+    }
+    void store(float* p) const { for (int i = 0; i < N; ++i) p[i] = v[i]; }
+
+#define RT_SCALAR_BINARY(op, expr)                                                       \
+    friend vfloat_scalar op(const vfloat_scalar& a, const vfloat_scalar& b)            \
+    {                                                                                    \
+        vfloat_scalar r;                                                                 \
+        for (int i = 0; i < N; ++i) r.v[i] = expr;                                       \
+        return r;                                                                        \
+    }
+    RT_SCALAR_BINARY(operator+, a.v[i] + b.v[i])
+    RT_SCALAR_BINARY(operator-, a.v[i] - b.v[i])
+    RT_SCALAR_BINARY(operator*, a.v[i] * b.v[i])
+    RT_SCALAR_BINARY(operator/, a.v[i] / b.v[i])
+    // like minps/maxps: the second operand is returned when either one is NaN
+    RT_SCALAR_BINARY(vmin, a.v[i] < b.v[i] ? a.v[i] : b.v[i])
+    RT_SCALAR_BINARY(vmax, a.v[i] > b.v[i] ? a.v[i] : b.v[i])
+#undef RT_SCALAR_BINARY
+
+#define RT_SCALAR_COMPARE(op)                                                            \
+    friend mask operator op(const vfloat_scalar& a, const vfloat_scalar& b)            \
+    {                                                                                    \
+        mask r;                                                                          \
+        for (int i = 0; i < N; ++i) r.m[i] = a.v[i] op b.v[i];                           \
+        return r;                                                                        \
+    }
+    RT_SCALAR_COMPARE(<)
+    RT_SCALAR_COMPARE(<=)
+    RT_SCALAR_COMPARE(>)
+    RT_SCALAR_COMPARE(>=)
+#undef RT_SCALAR_COMPARE
+
+    friend vfloat_scalar vabs(const vfloat_scalar& a)
+    {
+        vfloat_scalar r;
+        for (int i = 0; i < N; ++i) r.v[i] = a.v[i] < 0 ? -a.v[i] : a.v[i];
+        return r;
+    }
+};
+
+#ifdef RT_SSE
+struct vmask4
+{
+    __m128 m;
+    int bits() const { return _mm_movemask_ps(m); }
+    friend vmask4 operator&(vmask4 a, vmask4 b) { return vmask4{ _mm_and_ps(a.m, b.m) }; }
+    friend vmask4 operator|(vmask4 a, vmask4 b) { return vmask4{ _mm_or_ps(a.m, b.m) }; }
+};
+
+struct vfloat4
+{
+    static constexpr int size = 4;
+    using mask = vmask4;
+    __m128 v;
+
+    vfloat4() = default;
+    explicit vfloat4(__m128 x) : v(x) {}
+    vfloat4(float s) : v(_mm_set1_ps(s)) {}
+    // p must be 16 byte aligned
+    static vfloat4 load(const float* p) { return vfloat4(_mm_load_ps(p)); }
+    void store(float* p) const { _mm_store_ps(p, v); }
+
+    friend vfloat4 operator+(vfloat4 a, vfloat4 b) { return vfloat4(_mm_add_ps(a.v, b.v)); }
+    friend vfloat4 operator-(vfloat4 a, vfloat4 b) { return vfloat4(_mm_sub_ps(a.v, b.v)); }
+    friend vfloat4 operator*(vfloat4 a, vfloat4 b) { return vfloat4(_mm_mul_ps(a.v, b.v)); }
+    friend vfloat4 operator/(vfloat4 a, vfloat4 b) { return vfloat4(_mm_div_ps(a.v, b.v)); }
+    friend vfloat4 vmin(vfloat4 a, vfloat4 b) { return vfloat4(_mm_min_ps(a.v, b.v)); }
+    friend vfloat4 vmax(vfloat4 a, vfloat4 b) { return vfloat4(_mm_max_ps(a.v, b.v)); }
+    friend vfloat4 vabs(vfloat4 a) { return vfloat4(_mm_andnot_ps(_mm_set1_ps(-0.0f), a.v)); }
+    friend vmask4 operator<(vfloat4 a, vfloat4 b) { return vmask4{ _mm_cmplt_ps(a.v, b.v) }; }
+    friend vmask4 operator<=(vfloat4 a, vfloat4 b) { return vmask4{ _mm_cmple_ps(a.v, b.v) }; }
+    friend vmask4 operator>(vfloat4 a, vfloat4 b) { return vmask4{ _mm_cmpgt_ps(a.v, b.v) }; }
+    friend vmask4 operator>=(vfloat4 a, vfloat4 b) { return vmask4{ _mm_cmpge_ps(a.v, b.v) }; }
+};
+#else
+using vfloat4 = vfloat_scalar<4>;
+using vmask4 = vmask_scalar<4>;
+#endif
+
+#ifdef RT_AVX
+struct vmask8
+{
+    __m256 m;
+    int bits() const { return _mm256_movemask_ps(m); }
+    friend vmask8 operator&(vmask8 a, vmask8 b) { return vmask8{ _mm256_and_ps(a.m, b.m) }; }
+    friend vmask8 operator|(vmask8 a, vmask8 b) { return vmask8{ _mm256_or_ps(a.m, b.m) }; }
+};
+
+struct vfloat8
+{
+    static constexpr int size = 8;
+    using mask = vmask8;
+    __m256 v;
+
+    vfloat8() = default;
+    explicit vfloat8(__m256 x) : v(x) {}
+    vfloat8(float s) : v(_mm256_set1_ps(s)) {}
+    // p must be 32 byte aligned
+    static vfloat8 load(const float* p) { return vfloat8(_mm256_load_ps(p)); }
+    void store(float* p) const { _mm256_store_ps(p, v); }
+
+    friend vfloat8 operator+(vfloat8 a, vfloat8 b) { return vfloat8(_mm256_add_ps(a.v, b.v)); }
+    friend vfloat8 operator-(vfloat8 a, vfloat8 b) { return vfloat8(_mm256_sub_ps(a.v, b.v)); }
+    friend vfloat8 operator*(vfloat8 a, vfloat8 b) { return vfloat8(_mm256_mul_ps(a.v, b.v)); }
+    friend vfloat8 operator/(vfloat8 a, vfloat8 b) { return vfloat8(_mm256_div_ps(a.v, b.v)); }
+    friend vfloat8 vmin(vfloat8 a, vfloat8 b) { return vfloat8(_mm256_min_ps(a.v, b.v)); }
+    friend vfloat8 vmax(vfloat8 a, vfloat8 b) { return vfloat8(_mm256_max_ps(a.v, b.v)); }
+    friend vfloat8 vabs(vfloat8 a) { return vfloat8(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v)); }
+    friend vmask8 operator<(vfloat8 a, vfloat8 b) { return vmask8{ _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+    friend vmask8 operator<=(vfloat8 a, vfloat8 b) { return vmask8{ _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+    friend vmask8 operator>(vfloat8 a, vfloat8 b) { return vmask8{ _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+    friend vmask8 operator>=(vfloat8 a, vfloat8 b) { return vmask8{ _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+};
+#else
+using vfloat8 = vfloat_scalar<8>;
+using vmask8 = vmask_scalar<8>;
+#endif
+
+// vfloat type for a packet width
+template <int N> struct SimdFloat;
+template <> struct SimdFloat<4> { using type = vfloat4; };
+template <> struct SimdFloat<8> { using type = vfloat8; };
@@ -27,9 +27,9 @@ public:
         float t0, t1;
         float area = 4 * M_PI * radius2;
         if (!solveQuadratic(a, b, c, t0, t1)) return false;
-        if (t0 <= 0) t0 = t1;
-        if (t0 <= 0) return false;
-        return true;
+        if (t0 <= ray.t_min) t0 = t1;
+        if (t0 <= ray.t_min) return false;
+        return t0 < ray.t_max;
     }
     bool intersect(const Ray& ray, float &tnear, uint32_t &index) const
     {
@@ -106,6 +106,9 @@ public:
     bool hasEmit(){
         return m->hasEmission();
     }
+    Material* getMaterial(){
+        return m;
+    }
 };
 
 
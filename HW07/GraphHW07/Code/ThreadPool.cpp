@@ -0,0 +1,116 @@
+//
+// Persistent worker pool with per-worker work-stealing task queues.
+//
+
+#include "ThreadPool.hpp"
+#include <chrono>
+
+ThreadPool::ThreadPool(int threadCount)
+{
+    if (threadCount < 1) threadCount = 1;
+
+    for (int i = 0; i < threadCount; ++i) {
+        queues.emplace_back(std::make_unique<WorkQueue>());
+    }
+    for (int i = 0; i < threadCount; ++i) {
+        workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeCv.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::Run(int taskCount, const Task& task, const Progress& progress)
+{
+    if (taskCount <= 0) return;
+
+    // hand out contiguous blocks so neighbouring tiles stay on the same core
+    int workerCount = size();
+    for (int w = 0; w < workerCount; ++w) {
+        int begin = (int)((int64_t)taskCount * w / workerCount);
+        int end = (int)((int64_t)taskCount * (w + 1) / workerCount);
+
+        std::lock_guard<std::mutex> lock(queues[w]->mutex);
+        for (int t = begin; t < end; ++t) {
+            queues[w]->tasks.push_back(t);
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finishedTasks = 0;
+    job = &task;
+    busyWorkers = workerCount;
+    ++generation;
+    wakeCv.notify_all();
+
+    while (busyWorkers > 0) {
+        doneCv.wait_for(lock, std::chrono::milliseconds(100));
+        if (progress) {
+            progress((float)finishedTasks / taskCount);
+        }
+    }
+    job = nullptr;
+}
+
+bool ThreadPool::PopTask(int workerIx, int& taskIx)
+{
+    {
+        WorkQueue& own = *queues[workerIx];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            taskIx = own.tasks.front();
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+
+    // own queue is drained, steal from the far end of a victim's queue
+    int workerCount = size();
+    for (int k = 1; k < workerCount; ++k) {
+        WorkQueue& victim = *queues[(workerIx + k) % workerCount];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            taskIx = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::WorkerLoop(int workerIx)
+{
+    uint64_t seenGeneration = 0;
+
+    while (true) {
+        const Task* task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeCv.wait(lock, [&] { return stopping || generation != seenGeneration; });
+            if (stopping) return;
+            seenGeneration = generation;
+            task = job;
+        }
+
+        // tasks are never added during a run, so an empty sweep means this worker is done
+        int taskIx;
+        while (PopTask(workerIx, taskIx)) {
+            (*task)(taskIx, workerIx);
+            ++finishedTasks;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--busyWorkers == 0) {
+            doneCv.notify_all();
+        }
+    }
+}
@@ -0,0 +1,59 @@
+//
+// Persistent worker pool with per-worker work-stealing task queues.
+//
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+    // task(taskIx, workerIx)
+    using Task = std::function<void(int, int)>;
+    using Progress = std::function<void(float)>;
+
+    explicit ThreadPool(int threadCount);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return (int)workers.size(); }
+
+    // Run task for every index in [0, taskCount) and block until all of them are done.
+    // Each worker first drains a contiguous block of indices from its own queue, then
+    // steals from the back of the other queues, so one slow task never stalls the pool.
+    // progress is called on the calling thread while it waits.
+    void Run(int taskCount, const Task& task, const Progress& progress = nullptr);
+
+private:
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+
+    void WorkerLoop(int workerIx);
+    bool PopTask(int workerIx, int& taskIx);
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+
+    std::mutex mutex;
+    std::condition_variable wakeCv;
+    std::condition_variable doneCv;
+    const Task* job = nullptr;
+    uint64_t generation = 0;
+    int busyWorkers = 0;
+    bool stopping = false;
+    std::atomic<int> finishedTasks{ 0 };
+};
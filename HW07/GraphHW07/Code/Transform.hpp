@@ -0,0 +1,138 @@
+//
+// Affine transform: a 3x4 matrix and its inverse, kept together so points, vectors
+// and normals can go either way without inverting again.
+//
+
+#pragma once
+
+#include "Bounds3.hpp"
+#include "Vector.hpp"
+#include "global.hpp"
+#include <cmath>
+
+class Transform
+{
+public:
+    // identity
+    Transform()
+    {
+        for (int r = 0; r < 3; ++r)
+            for (int c = 0; c < 4; ++c)
+                m[r][c] = mInv[r][c] = r == c ? 1.0f : 0.0f;
+    }
+
+    static Transform Translate(const Vector3f& t)
+    {
+        Transform tr;
+        tr.m[0][3] = t.x; tr.m[1][3] = t.y; tr.m[2][3] = t.z;
+        tr.mInv[0][3] = -t.x; tr.mInv[1][3] = -t.y; tr.mInv[2][3] = -t.z;
+        return tr;
+    }
+
+    static Transform Scale(const Vector3f& s)
+    {
+        Transform tr;
+        tr.m[0][0] = s.x; tr.m[1][1] = s.y; tr.m[2][2] = s.z;
+        tr.mInv[0][0] = 1 / s.x; tr.mInv[1][1] = 1 / s.y; tr.mInv[2][2] = 1 / s.z;
+        return tr;
+    }
+
+    // counter-clockwise around axis when looking against it
+    static Transform Rotate(const Vector3f& axis, float degrees)
+    {
+        Vector3f a = normalize(axis);
+        float theta = degrees * M_PI / 180.0f;
+        float s = std::sin(theta), c = std::cos(theta);
+        Transform tr;
+        tr.m[0][0] = a.x * a.x + (1 - a.x * a.x) * c;
+        tr.m[0][1] = a.x * a.y * (1 - c) - a.z * s;
+        tr.m[0][2] = a.x * a.z * (1 - c) + a.y * s;
+        tr.m[1][0] = a.x * a.y * (1 - c) + a.z * s;
+        tr.m[1][1] = a.y * a.y + (1 - a.y * a.y) * c;
+        tr.m[1][2] = a.y * a.z * (1 - c) - a.x * s;
+        tr.m[2][0] = a.x * a.z * (1 - c) - a.y * s;
+        tr.m[2][1] = a.y * a.z * (1 - c) + a.x * s;
+        tr.m[2][2] = a.z * a.z + (1 - a.z * a.z) * c;
+        // a rotation's inverse is its transpose
+        for (int r = 0; r < 3; ++r)
+            for (int col = 0; col < 3; ++col)
+                tr.mInv[r][col] = tr.m[col][r];
+        return tr;
+    }
+
+    // this applied after t
+    Transform operator*(const Transform& t) const
+    {
+        Transform tr;
+        multiply(m, t.m, tr.m);
+        multiply(t.mInv, mInv, tr.mInv);
+        return tr;
+    }
+
+    Transform Inverse() const
+    {
+        Transform tr;
+        for (int r = 0; r < 3; ++r)
+            for (int c = 0; c < 4; ++c) {
+                tr.m[r][c] = mInv[r][c];
+                tr.mInv[r][c] = m[r][c];
+            }
+        return tr;
+    }
+
+    Vector3f Point(const Vector3f& p) const
+    {
+        return Vector3f(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                        m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                        m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+    }
+
+    Vector3f Vector(const Vector3f& v) const
+    {
+        return Vector3f(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                        m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                        m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+
+    // normals go through the inverse transpose, the result is not normalized
+    Vector3f Normal(const Vector3f& n) const
+    {
+        return Vector3f(mInv[0][0] * n.x + mInv[1][0] * n.y + mInv[2][0] * n.z,
+                        mInv[0][1] * n.x + mInv[1][1] * n.y + mInv[2][1] * n.z,
+                        mInv[0][2] * n.x + mInv[1][2] * n.y + mInv[2][2] * n.z);
+    }
+
+    // box around the transformed corners
+    Bounds3 operator()(const Bounds3& b) const
+    {
+        Bounds3 result;
+        for (int corner = 0; corner < 8; ++corner) {
+            Vector3f p(corner & 1 ? b.pMax.x : b.pMin.x,
+                       corner & 2 ? b.pMax.y : b.pMin.y,
+                       corner & 4 ? b.pMax.z : b.pMin.z);
+            result = Union(result, Point(p));
+        }
+        return result;
+    }
+
+    // of the linear part: volume scale, negative when handedness flips
+    float Determinant() const
+    {
+        return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+             - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+             + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+
+private:
+    // affine 3x4 product, the implicit fourth row is (0, 0, 0, 1)
+    static void multiply(const float a[3][4], const float b[3][4], float out[3][4])
+    {
+        for (int r = 0; r < 3; ++r)
+            for (int c = 0; c < 4; ++c) {
+                out[r][c] = a[r][0] * b[0][c] + a[r][1] * b[1][c] + a[r][2] * b[2][c] + (c == 3 ? a[r][3] : 0.0f);
+            }
+    }
+
+    float m[3][4];
+    float mInv[3][4];
+};
@@ -1,13 +1,18 @@
 #pragma once
 
+#include "AliasTable.hpp"
 #include "BVH.hpp"
 #include "Intersection.hpp"
 #include "Material.hpp"
-#include "OBJ_Loader.hpp"
+#include "ObjParser.hpp"
 #include "Object.hpp"
+#include "Profiler.hpp"
+#include "SceneCache.hpp"
 #include "Triangle.hpp"
+#include "TriangleBuffer.hpp"
 #include <cassert>
 #include <array>
+#include <bitset>
 
 bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
                           const Vector3f& v2, const Vector3f& orig,
@@ -73,6 +78,10 @@ public:
     }
     Vector3f evalDiffuseColor(const Vector2f&) const override;
     Bounds3 getBounds() override;
+    void getIntersection4(const RayPacket4& packet, int mask, Intersection* hits) override { intersectPacket(packet, mask, hits); }
+    void getIntersection8(const RayPacket8& packet, int mask, Intersection* hits) override { intersectPacket(packet, mask, hits); }
+    template <int N>
+    void intersectPacket(const RayPacket<N>& packet, int mask, Intersection* hits);
     void Sample(Intersection &pos, float &pdf){
         float x = std::sqrt(get_random_float()), y = get_random_float();
         // һ, ߺΪ1, Ҿ0
@@ -90,68 +99,139 @@ public:
     bool hasEmit(){
         return m->hasEmission();
     }
+    Material* getMaterial(){
+        return m;
+    }
 };
 
 class MeshTriangle : public Object
 {
 public:
-    MeshTriangle(const std::string& filename, Material *mt = new Material())
+    // BVH parameters of every mesh
+    static constexpr int kMaxPrimsInNode = 4;
+    static constexpr int kBucketSize = 18;
+    // OBJ meshes go through the scene cache next to the file, see SceneCache.hpp
+    static inline bool useSceneCache = true;
+
+    MeshTriangle(const std::string& filename, Material *mt = new Material(),
+                 BVHAccel::Layout layout = BVHAccel::Layout::BINARY)
+    {
+        setMaterial(mt);
+        uint64_t key = useSceneCache ? MeshCacheKey(filename, kMaxPrimsInNode, kBucketSize) : 0;
+        std::string cachePath = MeshCachePath(filename);
+        std::vector<LinearBVHNode> nodes;
+        std::vector<float> nodeAreas;
+        if (key && LoadMeshCache(cachePath, key, kMaxPrimsInNode, triangles, bounding_box, nodes, nodeAreas)) {
+            bvh = std::make_unique<BVHAccel>(&triangles, std::move(nodes), std::move(nodeAreas),
+                                             kMaxPrimsInNode, kBucketSize, layout);
+            updateAreas();
+            return;
+        }
+        build(loadMesh(filename), layout);
+        if (key && triangles.size() > 0 && !SaveMeshCache(cachePath, key, triangles, bounding_box, *bvh)) {
+            std::cout << "could not write " << cachePath << "\n";
+        }
+    }
+
+    // every three consecutive vertices form one triangle
+    MeshTriangle(const std::vector<Vector3f>& verts, Material *mt = new Material(),
+                 BVHAccel::Layout layout = BVHAccel::Layout::BINARY)
+    {
+        setMaterial(mt);
+        build(verts, layout);
+    }
+
+    // indexed mesh, its normals and uvs (if any) are interpolated over the triangles
+    MeshTriangle(ObjMesh mesh, Material *mt = new Material(),
+                 BVHAccel::Layout layout = BVHAccel::Layout::BINARY)
+    {
+        setMaterial(mt);
+        build(std::move(mesh), layout);
+    }
+
+    // move the vertices of the mesh, given in the order of construction. the BVH is refitted,
+    // or built again when refitting has made it much slower
+    void SetVertices(const std::vector<Vector3f>& verts)
+    {
+        for (int k = 0; k < triangles.size(); ++k) {
+            size_t i = 3 * (size_t)triangles.sourceIndex(k);
+            triangles.Set(k, verts[i], verts[i + 1], verts[i + 2]);
+        }
+        bounding_box = triangles.Bounds();
+        bvh->Update();
+        updateAreas();
+    }
+
+    // triangles.owner and the BVH point back into this object
+    MeshTriangle(const MeshTriangle&) = delete;
+    MeshTriangle& operator=(const MeshTriangle&) = delete;
+
+    void setMaterial(Material* mt)
     {
-        objl::Loader loader;
-        loader.LoadFile(filename);
-        area = 0;
         m = mt;
-        assert(loader.LoadedMeshes.size() == 1);
-        auto mesh = loader.LoadedMeshes[0];
-
-        Vector3f min_vert = Vector3f{std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity()};
-        Vector3f max_vert = Vector3f{-std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity()};
-        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
-            std::array<Vector3f, 3> face_vertices;
-
-            for (int j = 0; j < 3; j++) {
-                auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-                                     mesh.Vertices[i + j].Position.Y,
-                                     mesh.Vertices[i + j].Position.Z);
-                face_vertices[j] = vert;
-
-                min_vert = Vector3f(std::min(min_vert.x, vert.x),
-                                    std::min(min_vert.y, vert.y),
-                                    std::min(min_vert.z, vert.z));
-                max_vert = Vector3f(std::max(max_vert.x, vert.x),
-                                    std::max(max_vert.y, vert.y),
-                                    std::max(max_vert.z, vert.z));
-            }
+        triangles.owner = this;
+        triangles.materials.push_back(mt);
+    }
 
-            triangles.emplace_back(face_vertices[0], face_vertices[1],
-                                   face_vertices[2], mt);
+    void build(const std::vector<Vector3f>& verts, BVHAccel::Layout layout)
+    {
+        for (size_t i = 0; i + 2 < verts.size(); i += 3) {
+            triangles.Add(verts[i], verts[i + 1], verts[i + 2]);
         }
+        buildBVH(layout);
+    }
 
-        bounding_box = Bounds3(min_vert, max_vert);
+    void build(ObjMesh&& mesh, BVHAccel::Layout layout)
+    {
+        MergeAttributeIndices(mesh);
+        triangles.positions = std::move(mesh.positions);
+        triangles.normals = std::move(mesh.normals);
+        triangles.uvs = std::move(mesh.uvs);
+        for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+            triangles.Add(mesh.indices[i], mesh.indices[i + 1], mesh.indices[i + 2]);
+        }
+        buildBVH(layout);
+    }
 
-        std::vector<Object*> ptrs;
-        for (auto& tri : triangles){
-            ptrs.push_back(&tri);
+    void buildBVH(BVHAccel::Layout layout)
+    {
+        //bvh = new BVHAccel(ptrs);
+        bvh = std::make_unique<BVHAccel>(&triangles, kMaxPrimsInNode, kBucketSize, layout);
+        // the build drops the vertices no triangle uses
+        bounding_box = triangles.Bounds();
+        updateAreas();
+    }
+
+    // total area and the area table, triangles may have been moved or reordered
+    void updateAreas()
+    {
+        area = 0;
+        std::vector<float> areas;
+        for (int k = 0; k < triangles.size(); ++k) {
+            areas.push_back(triangles.getArea(k));
             // ÿһ֮
-            area += tri.area;
+            area += areas.back();
         }
-        //bvh = new BVHAccel(ptrs);
-        bvh = new BVHAccel(ptrs, 1, BVHAccel::SplitMethod::SAH, 18);
+        triangleTable = AliasTable(areas);
+    }
+
+    static ObjMesh loadMesh(const std::string& filename)
+    {
+        ObjMesh mesh;
+        std::string error;
+        if (!LoadObj(filename, mesh, &error)) {
+            std::cerr << error << std::endl;
+        }
+        return mesh;
     }
 
-    bool intersect(const Ray& ray) { return true; }
+    bool intersect(const Ray& ray) { return bvh && bvh->IntersectP(ray); }
 
     bool intersect(const Ray& ray, float& tnear, uint32_t& index) const
     {
         bool intersect = false;
-        for (uint32_t k = 0; k < numTriangles; ++k) {
-            const Vector3f& v0 = vertices[vertexIndex[k * 3]];
-            const Vector3f& v1 = vertices[vertexIndex[k * 3 + 1]];
-            const Vector3f& v2 = vertices[vertexIndex[k * 3 + 2]];
+        for (int k = 0; k < triangles.size(); ++k) {
+            Vector3f v0 = triangles.corner(k, 0), v1 = triangles.corner(k, 1), v2 = triangles.corner(k, 2);
             float t, u, v;
             if (rayTriangleIntersect(v0, v1, v2, ray.origin, ray.direction, t,
                                      u, v) &&
@@ -171,16 +251,10 @@ public:
                               const uint32_t& index, const Vector2f& uv,
                               Vector3f& N, Vector2f& st) const
     {
-        const Vector3f& v0 = vertices[vertexIndex[index * 3]];
-        const Vector3f& v1 = vertices[vertexIndex[index * 3 + 1]];
-        const Vector3f& v2 = vertices[vertexIndex[index * 3 + 2]];
-        Vector3f e0 = normalize(v1 - v0);
-        Vector3f e1 = normalize(v2 - v1);
-        N = normalize(crossProduct(e0, e1));
-        const Vector2f& st0 = stCoordinates[vertexIndex[index * 3]];
-        const Vector2f& st1 = stCoordinates[vertexIndex[index * 3 + 1]];
-        const Vector2f& st2 = stCoordinates[vertexIndex[index * 3 + 2]];
-        st = st0 * (1 - uv.x - uv.y) + st1 * uv.x + st2 * uv.y;
+        Intersection surface;
+        triangles.SurfaceAt(index, uv.x, uv.y, surface);
+        N = surface.normal;
+        st = Vector2f(surface.tcoords.x, surface.tcoords.y);
     }
 
     Vector3f evalDiffuseColor(const Vector2f& st) const
@@ -202,10 +276,22 @@ public:
 
         return intersec;
     }
+
+    void getIntersection4(const RayPacket4& packet, int mask, Intersection* hits)
+    {
+        if (bvh) bvh->Intersect4(packet, hits, mask);
+    }
+
+    void getIntersection8(const RayPacket8& packet, int mask, Intersection* hits)
+    {
+        if (bvh) bvh->Intersect8(packet, hits, mask);
+    }
     
     void Sample(Intersection &pos, float &pdf){
-        // meshtriangleͬڶbvh
-        bvh->Sample(pos, pdf);
+        // aliasѡһ, ھȲ, 
+        int k = triangleTable.Sample(get_random_float());
+        triangles.Sample(k, pos, pdf);
+        pdf = 1.0f / area;
         pos.emit = m->getEmission();
     }
     float getArea(){
@@ -214,22 +300,30 @@ public:
     bool hasEmit(){
         return m->hasEmission();
     }
+    Material* getMaterial(){
+        return m;
+    }
 
     Bounds3 bounding_box;
-    std::unique_ptr<Vector3f[]> vertices;
-    uint32_t numTriangles;
-    std::unique_ptr<uint32_t[]> vertexIndex;
-    std::unique_ptr<Vector2f[]> stCoordinates;
 
-    std::vector<Triangle> triangles;
+    // owned here, the BVH leaves index into it
+    TriangleBuffer triangles;
+    // triangle index drawn in proportion to its area
+    AliasTable triangleTable;
 
-    BVHAccel* bvh;
+    std::unique_ptr<BVHAccel> bvh;
     float area;
 
     Material* m;
 };
 
-inline bool Triangle::intersect(const Ray& ray) { return true; }
+// getIntersection without the payload, for shadow rays
+inline bool Triangle::intersect(const Ray& ray)
+{
+    RT_PROFILE_COUNT(TriangleTests, 1);
+    double u, v, t;
+    return rayTriangleHit(ray, v0, e1, e2, u, v, t);
+}
 inline bool Triangle::intersect(const Ray& ray, float& tnear,
                                 uint32_t& index) const
 {
@@ -240,33 +334,17 @@ inline Bounds3 Triangle::getBounds() { return Union(Bounds3(v0, v1), v2); }
 
 inline Intersection Triangle::getIntersection(Ray ray)
 {
+    RT_PROFILE_COUNT(TriangleTests, 1);
     Intersection inter;
 
     // ﱣ֤򵽵ͼ, ɻͼεı, ҲӦñ
     // 赲. ҵbvhڵ㷨ܴ򵹸Զ
     // Ҳuv
-    if (dotProduct(ray.direction, normal) > 0)
-        return inter;
-    double u, v, t_tmp = 0;
-    Vector3f pvec = crossProduct(ray.direction, e2);
-    double det = dotProduct(e1, pvec);
-    if (fabs(det) < EPSILON)
-        return inter;
-
-    double det_inv = 1. / det;
-    Vector3f tvec = ray.origin - v0;
-    u = dotProduct(tvec, pvec) * det_inv;
-    if (u < 0 || u > 1)
-        return inter;
-    Vector3f qvec = crossProduct(tvec, e1);
-    v = dotProduct(ray.direction, qvec) * det_inv;
-    if (v < 0 || u + v > 1)
-        return inter;
-    t_tmp = dotProduct(e2, qvec) * det_inv;
-
-    // TODO find ray triangle intersection
+    // t(t_min, t_max)ڵĽrayTriangleHitų
     // 뱣֤tmp==0ʱΪ赲ڻԪ
-    if (t_tmp <= 0) return inter;
+    double u, v, t_tmp;
+    if (!rayTriangleHit(ray, v0, e1, e2, u, v, t_tmp))
+        return inter;
 
     inter.happened = true;
     inter.m = m;
@@ -277,6 +355,61 @@ inline Intersection Triangle::getIntersection(Ray ray)
     return inter;
 }
 
+// same test as getIntersection, on N rays at once in single precision
+template <int N>
+inline void Triangle::intersectPacket(const RayPacket<N>& packet, int mask, Intersection* hits)
+{
+    RT_PROFILE_COUNT(TriangleTests, std::bitset<N>(mask).count());
+    using vfloat = typename SimdFloat<N>::type;
+
+    vfloat dx = vfloat::load(packet.dx), dy = vfloat::load(packet.dy), dz = vfloat::load(packet.dz);
+    vfloat facing = dx * normal.x + dy * normal.y + dz * normal.z;
+
+    // pvec = dir x e2
+    vfloat px = dy * e2.z - dz * e2.y;
+    vfloat py = dz * e2.x - dx * e2.z;
+    vfloat pz = dx * e2.y - dy * e2.x;
+    vfloat det = px * e1.x + py * e1.y + pz * e1.z;
+    vfloat detInv = vfloat(1.f) / det;
+
+    vfloat tx = vfloat::load(packet.ox) - v0.x;
+    vfloat ty = vfloat::load(packet.oy) - v0.y;
+    vfloat tz = vfloat::load(packet.oz) - v0.z;
+    vfloat u = (tx * px + ty * py + tz * pz) * detInv;
+
+    // qvec = tvec x e1
+    vfloat qx = ty * e1.z - tz * e1.y;
+    vfloat qy = tz * e1.x - tx * e1.z;
+    vfloat qz = tx * e1.y - ty * e1.x;
+    vfloat v = (dx * qx + dy * qy + dz * qz) * detInv;
+    vfloat t = (qx * e2.x + qy * e2.y + qz * e2.z) * detInv;
+
+    alignas(32) float tMax[N];
+    for (int lane = 0; lane < N; ++lane) {
+        tMax[lane] = hits[lane].distanceBound();
+    }
+
+    auto hit = (facing <= vfloat(0.f)) & (vabs(det) >= vfloat(EPSILON))
+        & (u >= vfloat(0.f)) & (u <= vfloat(1.f)) & (v >= vfloat(0.f)) & (u + v <= vfloat(1.f))
+        & (t > vfloat(0.f)) & (t < vfloat::load(tMax));
+    int hitMask = hit.bits() & mask;
+    if (!hitMask) return;
+
+    alignas(32) float tHit[N];
+    t.store(tHit);
+    for (int lane = 0; lane < N; ++lane) {
+        if (!(hitMask & (1 << lane))) continue;
+        Intersection& inter = hits[lane];
+        Vector3f origin(packet.ox[lane], packet.oy[lane], packet.oz[lane]);
+        inter.happened = true;
+        inter.m = m;
+        inter.obj = this;
+        inter.coords = origin + tHit[lane] * Vector3f(packet.dx[lane], packet.dy[lane], packet.dz[lane]);
+        inter.distance = (inter.coords - origin).norm();
+        inter.normal = normal;
+    }
+}
+
 inline Vector3f Triangle::evalDiffuseColor(const Vector2f&) const
 {
     return Vector3f(0.5, 0.5, 0.5);
@@ -0,0 +1,288 @@
+//
+// Triangles of a mesh as an indexed mesh: a vertex buffer shared by all triangles and three
+// 32 bit indices per triangle, materials by index. Edges and normals are computed from the
+// corners when a triangle is tested. BVH leaves index it directly, so intersecting a triangle
+// is no virtual call, and a dense mesh takes about 24 bytes per triangle instead of 54.
+//
+
+#pragma once
+
+#include "Bounds3.hpp"
+#include "Intersection.hpp"
+#include "Object.hpp"
+#include "Profiler.hpp"
+#include "Ray.hpp"
+#include "RayPacket.hpp"
+#include "Simd.hpp"
+#include "global.hpp"
+#include <bitset>
+#include <cstdint>
+#include <vector>
+
+// Moeller-Trumbore test of ray against the triangle p0, p0 + e1, p0 + e2: barycentrics u, v (the
+// weights of corners 1 and 2) and ray parameter t of the hit. det is minus the cosine between ray
+// and normal, scaled: rays from behind have det < 0 and are culled together with the ones along
+// the plane. only hits with ray.t_min < t < ray.t_max count
+inline bool rayTriangleHit(const Ray& ray, const Vector3f& p0, const Vector3f& e1, const Vector3f& e2,
+                           double& u, double& v, double& t)
+{
+    Vector3f pvec = crossProduct(ray.direction, e2);
+    double det = dotProduct(e1, pvec);
+    if (det < EPSILON)
+        return false;
+
+    double det_inv = 1. / det;
+    Vector3f tvec = ray.origin - p0;
+    u = dotProduct(tvec, pvec) * det_inv;
+    if (u < 0 || u > 1)
+        return false;
+    Vector3f qvec = crossProduct(tvec, e1);
+    v = dotProduct(ray.direction, qvec) * det_inv;
+    if (v < 0 || u + v > 1)
+        return false;
+    t = dotProduct(e2, qvec) * det_inv;
+    return t > ray.t_min && t < ray.t_max;
+}
+
+class TriangleBuffer
+{
+public:
+    // object reported as Intersection::obj for every triangle of the buffer
+    Object* owner = nullptr;
+    std::vector<Material*> materials;
+
+    // vertices shared by the triangles. normals and uvs are empty or one per position; when
+    // present they are interpolated over the triangles, otherwise the flat normal is used
+    std::vector<Vector3f> positions;
+    std::vector<Vector3f> normals;
+    std::vector<Vector2f> uvs;
+
+    // triangle over positions a, b, c counter-clockwise, material is an index into materials
+    void Add(uint32_t a, uint32_t b, uint32_t c, uint16_t material = 0)
+    {
+        indices.insert(indices.end(), { a, b, c });
+        materialIx.push_back(material);
+        sourceIx.push_back(size() - 1);
+    }
+    // triangle with three vertices of its own
+    void Add(const Vector3f& v0, const Vector3f& v1, const Vector3f& v2, uint16_t material = 0)
+    {
+        uint32_t first = (uint32_t)positions.size();
+        positions.insert(positions.end(), { v0, v1, v2 });
+        Add(first, first + 1, first + 2, material);
+    }
+
+    // move the corners of triangle ix, and so of every triangle sharing them
+    void Set(int ix, const Vector3f& v0, const Vector3f& v1, const Vector3f& v2)
+    {
+        positions[indices[3 * ix]] = v0;
+        positions[indices[3 * ix + 1]] = v1;
+        positions[indices[3 * ix + 2]] = v2;
+    }
+
+    int size() const { return (int)materialIx.size(); }
+
+    Vector3f corner(int ix, int k) const { return positions[indices[3 * ix + k]]; }
+    Vector3f v0(int ix) const { return corner(ix, 0); }
+    Vector3f edge1(int ix) const { return corner(ix, 1) - corner(ix, 0); }
+    Vector3f edge2(int ix) const { return corner(ix, 2) - corner(ix, 0); }
+    Vector3f normal(int ix) const { return normalize(crossProduct(edge1(ix), edge2(ix))); }
+    Material* material(int ix) const { return materials[materialIx[ix]]; }
+    // position of triangle ix in the order it was added
+    int sourceIndex(int ix) const { return sourceIx[ix]; }
+
+    Bounds3 getBounds(int ix) const
+    {
+        // corners as the intersection tests see them, v0 plus the edges
+        Vector3f p0 = v0(ix);
+        return Union(Bounds3(p0, p0 + edge1(ix)), p0 + edge2(ix));
+    }
+    float getArea(int ix) const { return crossProduct(edge1(ix), edge2(ix)).norm() * 0.5f; }
+    // all positions, after Reorder exactly those the triangles use
+    Bounds3 Bounds() const
+    {
+        Bounds3 bounds;
+        for (const Vector3f& p : positions) bounds = Union(bounds, p);
+        return bounds;
+    }
+
+    // Triangle::getIntersection, isect is only overwritten by a closer hit
+    // within (ray.t_min, ray.t_max)
+    bool intersect(int ix, const Ray& ray, Intersection& isect) const;
+    // Triangle::intersect, any hit within (ray.t_min, ray.t_max)
+    bool intersectP(int ix, const Ray& ray) const;
+    // Triangle::intersectPacket
+    template <int N>
+    void intersectPacket(int ix, const RayPacket<N>& packet, int mask, Intersection* hits) const;
+    // uniform point on triangle ix
+    void Sample(int ix, Intersection& pos, float& pdf) const;
+    // material, normal and uv of triangle ix at barycentrics b1, b2 (the weights of corners 1 and 2)
+    void SurfaceAt(int ix, float b1, float b2, Intersection& isect) const;
+
+    // new triangle i is old triangle order[i]. vertices are renumbered in the order the
+    // triangles first use them, so the corners of neighbouring triangles are close in
+    // memory, and vertices no triangle uses are dropped
+    void Reorder(const std::vector<int>& order)
+    {
+        const uint32_t unused = 0xffffffffu;
+        std::vector<uint32_t> renumber(positions.size(), unused);
+        std::vector<uint32_t> vertexOrder;
+        vertexOrder.reserve(positions.size());
+        std::vector<uint32_t> sortedIndices(3 * order.size());
+        std::vector<uint16_t> sortedMaterials(order.size());
+        std::vector<int> sortedSources(order.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            for (int k = 0; k < 3; ++k) {
+                uint32_t& vertex = renumber[indices[3 * (size_t)order[i] + k]];
+                if (vertex == unused) {
+                    vertex = (uint32_t)vertexOrder.size();
+                    vertexOrder.push_back(indices[3 * (size_t)order[i] + k]);
+                }
+                sortedIndices[3 * i + k] = vertex;
+            }
+            sortedMaterials[i] = materialIx[order[i]];
+            sortedSources[i] = sourceIx[order[i]];
+        }
+        indices.swap(sortedIndices);
+        materialIx.swap(sortedMaterials);
+        sourceIx.swap(sortedSources);
+        gather(positions, vertexOrder);
+        gather(normals, vertexOrder);
+        gather(uvs, vertexOrder);
+    }
+
+    // bytes held by the triangles and their vertices
+    size_t Bytes() const
+    {
+        return positions.size() * sizeof(Vector3f) + normals.size() * sizeof(Vector3f) + uvs.size() * sizeof(Vector2f)
+            + indices.size() * sizeof(uint32_t) + materialIx.size() * sizeof(uint16_t) + sourceIx.size() * sizeof(int);
+    }
+
+    // per-triangle arrays, for SceneCache. three corner indices per triangle
+    std::vector<uint32_t>& Indices() { return indices; }
+    const std::vector<uint32_t>& Indices() const { return indices; }
+    std::vector<uint16_t>& MaterialIndices() { return materialIx; }
+    const std::vector<uint16_t>& MaterialIndices() const { return materialIx; }
+    std::vector<int>& SourceIndices() { return sourceIx; }
+    const std::vector<int>& SourceIndices() const { return sourceIx; }
+
+private:
+    template <typename T>
+    static void gather(std::vector<T>& values, const std::vector<uint32_t>& order)
+    {
+        if (values.empty()) return;
+        std::vector<T> sorted(order.size());
+        for (size_t i = 0; i < order.size(); ++i) sorted[i] = values[order[i]];
+        values.swap(sorted);
+    }
+
+    std::vector<uint32_t> indices;
+    std::vector<uint16_t> materialIx;
+    std::vector<int> sourceIx;
+};
+
+inline bool TriangleBuffer::intersect(int ix, const Ray& ray, Intersection& isect) const
+{
+    RT_PROFILE_COUNT(TriangleTests, 1);
+    Vector3f p0 = v0(ix);
+    double u, v, t_tmp;
+    if (!rayTriangleHit(ray, p0, corner(ix, 1) - p0, corner(ix, 2) - p0, u, v, t_tmp))
+        return false;
+
+    Vector3f coords = ray.origin + t_tmp * ray.direction;
+    double distance = (coords - ray.origin).norm();
+    if (distance >= isect.distance)
+        return false;
+
+    isect.happened = true;
+    isect.coords = coords;
+    isect.distance = distance;
+    SurfaceAt(ix, (float)u, (float)v, isect);
+    return true;
+}
+
+inline bool TriangleBuffer::intersectP(int ix, const Ray& ray) const
+{
+    RT_PROFILE_COUNT(TriangleTests, 1);
+    Vector3f p0 = v0(ix);
+    double u, v, t;
+    return rayTriangleHit(ray, p0, corner(ix, 1) - p0, corner(ix, 2) - p0, u, v, t);
+}
+
+template <int N>
+inline void TriangleBuffer::intersectPacket(int ix, const RayPacket<N>& packet, int mask, Intersection* hits) const
+{
+    RT_PROFILE_COUNT(TriangleTests, std::bitset<N>(mask).count());
+    using vfloat = typename SimdFloat<N>::type;
+
+    const Vector3f p0 = v0(ix), e1 = corner(ix, 1) - p0, e2 = corner(ix, 2) - p0;
+    vfloat dx = vfloat::load(packet.dx), dy = vfloat::load(packet.dy), dz = vfloat::load(packet.dz);
+
+    // pvec = dir x e2
+    vfloat px = dy * e2.z - dz * e2.y;
+    vfloat py = dz * e2.x - dx * e2.z;
+    vfloat pz = dx * e2.y - dy * e2.x;
+    vfloat det = px * e1.x + py * e1.y + pz * e1.z;
+    vfloat detInv = vfloat(1.f) / det;
+
+    vfloat tx = vfloat::load(packet.ox) - p0.x;
+    vfloat ty = vfloat::load(packet.oy) - p0.y;
+    vfloat tz = vfloat::load(packet.oz) - p0.z;
+    vfloat u = (tx * px + ty * py + tz * pz) * detInv;
+
+    // qvec = tvec x e1
+    vfloat qx = ty * e1.z - tz * e1.y;
+    vfloat qy = tz * e1.x - tx * e1.z;
+    vfloat qz = tx * e1.y - ty * e1.x;
+    vfloat v = (dx * qx + dy * qy + dz * qz) * detInv;
+    vfloat t = (qx * e2.x + qy * e2.y + qz * e2.z) * detInv;
+
+    alignas(32) float tMax[N];
+    for (int lane = 0; lane < N; ++lane) {
+        tMax[lane] = hits[lane].distanceBound();
+    }
+
+    // front facing and not along the plane, as in intersect
+    auto hit = (det >= vfloat(EPSILON))
+        & (u >= vfloat(0.f)) & (u <= vfloat(1.f)) & (v >= vfloat(0.f)) & (u + v <= vfloat(1.f))
+        & (t > vfloat(0.f)) & (t < vfloat::load(tMax));
+    int hitMask = hit.bits() & mask;
+    if (!hitMask) return;
+
+    alignas(32) float tHit[N], uHit[N], vHit[N];
+    t.store(tHit);
+    u.store(uHit);
+    v.store(vHit);
+    for (int lane = 0; lane < N; ++lane) {
+        if (!(hitMask & (1 << lane))) continue;
+        Intersection& inter = hits[lane];
+        Vector3f origin(packet.ox[lane], packet.oy[lane], packet.oz[lane]);
+        inter.happened = true;
+        inter.coords = origin + tHit[lane] * Vector3f(packet.dx[lane], packet.dy[lane], packet.dz[lane]);
+        inter.distance = (inter.coords - origin).norm();
+        SurfaceAt(ix, uHit[lane], vHit[lane], inter);
+    }
+}
+
+inline void TriangleBuffer::Sample(int ix, Intersection& pos, float& pdf) const
+{
+    float x = std::sqrt(get_random_float()), y = get_random_float();
+    // same barycentric mapping as Triangle::Sample, written with the edges
+    float b1 = x * (1.0f - y), b2 = x * y;
+    pos.coords = v0(ix) + edge1(ix) * b1 + edge2(ix) * b2;
+    SurfaceAt(ix, b1, b2, pos);
+    pdf = 1.0f / getArea(ix);
+}
+
+inline void TriangleBuffer::SurfaceAt(int ix, float b1, float b2, Intersection& isect) const
+{
+    const uint32_t* c = &indices[3 * (size_t)ix];
+    float b0 = 1.0f - b1 - b2;
+    isect.m = material(ix);
+    isect.obj = owner;
+    isect.normal = normals.empty() ? normal(ix) : normalize(normals[c[0]] * b0 + normals[c[1]] * b1 + normals[c[2]] * b2);
+    if (!uvs.empty()) {
+        Vector2f uv = uvs[c[0]] * b0 + uvs[c[1]] * b1 + uvs[c[2]] * b2;
+        isect.tcoords = Vector3f(uv.x, uv.y, 0);
+    }
+}
@@ -18,8 +18,8 @@ public:
     Vector3f operator * (const float &r) const { return Vector3f(x * r, y * r, z * r); }
     Vector3f operator / (const float &r) const { return Vector3f(x / r, y / r, z / r); }
 
-    float norm() {return std::sqrt(x * x + y * y + z * z);}
-    Vector3f normalized() {
+    float norm() const {return std::sqrt(x * x + y * y + z * z);}
+    Vector3f normalized() const {
         float n = std::sqrt(x * x + y * y + z * z);
         return Vector3f(x / n, y / n, z / n);
     }
@@ -80,6 +80,10 @@ inline Vector3f normalize(const Vector3f &v)
 inline float dotProduct(const Vector3f &a, const Vector3f &b)
 { return a.x * b.x + a.y * b.y + a.z * b.z; }
 
+// Rec. 709 luminance of a linear RGB color
+inline float luminance(const Vector3f &c)
+{ return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+
 inline Vector3f crossProduct(const Vector3f &a, const Vector3f &b)
 {
     return Vector3f(
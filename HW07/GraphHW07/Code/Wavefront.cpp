@@ -0,0 +1,200 @@
+//
+// Wavefront path tracing, see Wavefront.hpp.
+//
+
+#include "Wavefront.hpp"
+#include "Renderer.hpp"
+#include <algorithm>
+
+void Wavefront::Render(const Scene& scene, float scale, float imageAspectRatio, const Tile* tiles, int tileCount,
+                       int samples, int maxPaths, uint64_t passSeed, Vector3f* target, float weight,
+                       PixelStats* stats)
+{
+    // a tile with many samples per pixel is split into batches of a few samples each. every
+    // pixel still adds its samples in sample order, so the image does not depend on maxPaths
+    int pixels = 0;
+    for (int t = 0; t < tileCount; ++t) {
+        pixels += (tiles[t].x1 - tiles[t].x0) * (tiles[t].y1 - tiles[t].y0);
+    }
+    int samplesPerBatch = std::max(1, std::min(samples, maxPaths / std::max(1, pixels)));
+
+    for (int firstSample = 0; firstSample < samples; firstSample += samplesPerBatch) {
+        int endSample = std::min(samples, firstSample + samplesPerBatch);
+        paths.clear();
+        active.clear();
+        for (int t = 0; t < tileCount; ++t) {
+            Generate(scene, scale, imageAspectRatio, tiles[t], samples, firstSample, endSample, passSeed, stats);
+        }
+
+        // one bounce of every live path per round
+        while (!active.empty()) {
+            Shade(scene);
+            TraceShadowRays(scene);
+            Extend(scene);
+        }
+
+        // in path order, which is pixel order, so the sums do not depend on how paths were scheduled
+        for (const Path& path : paths) {
+            target[path.pixelIx] += path.L * weight;
+            if (stats) stats[path.pixelIx].Add(luminance(path.L));
+        }
+    }
+}
+
+void Wavefront::Generate(const Scene& scene, float scale, float imageAspectRatio, const Tile& tile, int samples,
+                         int firstSample, int endSample, uint64_t passSeed, const PixelStats* stats)
+{
+    for (int j = tile.y0; j < tile.y1; ++j) {
+        for (int i0 = tile.x0; i0 < tile.x1; i0 += PrimaryPacket::size) {
+            // the camera ray of a pixel is shared by its samples, trace it once as in RenderTile
+            PrimaryPacket packet;
+            Vector3f dirs[PrimaryPacket::size];
+            Intersection hits[PrimaryPacket::size];
+            int count = std::min(PrimaryPacket::size, tile.x1 - i0);
+            for (int lane = 0; lane < count; ++lane) {
+                dirs[lane] = cameraRayDirection(scene, scale, imageAspectRatio, i0 + lane, j);
+                packet.Set(lane, Ray(scene.eyePos, dirs[lane]));
+            }
+            scene.intersect(packet, hits);
+
+            for (int lane = 0; lane < count; ++lane) {
+                size_t pixelIx = (size_t)j * scene.width + i0 + lane;
+                if (stats && stats[pixelIx].converged) continue;
+                for (int k = firstSample; k < endSample; ++k) {
+                    const Intersection& hit = hits[lane];
+                    Path path;
+                    path.SetVertex(hit);
+                    path.direction = dirs[lane];
+                    path.throughput = Vector3f(1, 1, 1);
+                    path.pixelIx = (uint32_t)pixelIx;
+                    path.rng.Seed(MixSeed(passSeed), (uint64_t)pixelIx * samples + k);
+                    // castPath's early outs: nothing hit or a light seen directly
+                    if (!hit.happened) {
+                        path.L = scene.backgroundColor;
+                    }
+                    else if (hit.obj->hasEmit()) {
+                        path.L = hit.m->getEmission();
+                    }
+                    else {
+                        active.push_back((int)paths.size());
+                    }
+                    paths.push_back(path);
+                }
+            }
+        }
+    }
+}
+
+void Wavefront::Shade(const Scene& scene)
+{
+    // paths on the same material run the same kernel back to back. a scene has a handful of
+    // materials, so this is a counting sort, which also keeps path order inside a material
+    materialKeys.clear();
+    std::vector<const CompiledMaterial*> materials;
+    std::vector<int> counts;
+    for (int pathIx : active) {
+        const CompiledMaterial* m = paths[pathIx].m->compiled;
+        int key = (int)(std::find(materials.begin(), materials.end(), m) - materials.begin());
+        if (key == (int)materials.size()) {
+            materials.push_back(m);
+            counts.push_back(0);
+        }
+        ++counts[key];
+        materialKeys.push_back(key);
+    }
+    int offset = 0;
+    for (int& count : counts) {
+        std::swap(count, offset);
+        offset += count;
+    }
+    sorted.resize(active.size());
+    for (size_t k = 0; k < active.size(); ++k) {
+        sorted[counts[materialKeys[k]]++] = active[k];
+    }
+
+    extended.clear();
+    shadowRays.clear();
+    // the sampling code draws from the thread's generator, lend it each path's stream
+    PCG32& rng = ThreadRng();
+    PCG32 ownStream = rng;
+    for (int pathIx : sorted) {
+        rng = paths[pathIx].rng;
+        if (ShadePath(scene, pathIx)) {
+            extended.push_back(pathIx);
+        }
+        paths[pathIx].rng = rng;
+    }
+    rng = ownStream;
+}
+
+bool Wavefront::ShadePath(const Scene& scene, int pathIx)
+{
+    RT_PROFILE_COUNT(PathVertices, 1);
+    Path& path = paths[pathIx];
+    bool lastBounce = scene.pathMaxDepth >= 0 && path.depth >= scene.pathMaxDepth;
+    const CompiledMaterial& bsdf = *path.m->compiled;
+    BSDFFrame frame = bsdf.frame(path.direction, path.normal);
+
+    Intersection hit;
+    hit.coords = path.coords;
+    hit.normal = path.normal;
+    hit.m = path.m;
+    Vector3f toLight, directL;
+    float distance;
+    if (scene.sampleDirectLight(hit, frame, !lastBounce, toLight, distance, directL)) {
+        shadowRays.push_back(ShadowRay{ path.coords, toLight, path.throughput * directL,
+                                        distance - EPSILON * 20, pathIx });
+    }
+    if (lastBounce) {
+        return false;
+    }
+
+    // 俄罗斯轮盘赌, rrStartDepth之前的弹射总是继续
+    float survive = 1.f;
+    if (path.depth >= scene.rrStartDepth) {
+        if (get_random_float() >= scene.RussianRoulette) return false;
+        survive = scene.RussianRoulette;
+    }
+
+    Vector3f wo = bsdf.sample(frame);
+    float cosTheta = dotProduct(wo, path.normal);
+    if (cosTheta <= 0) return false;
+
+    // taken before knowing whether wo hits anything, a path that misses ends with it unused
+    path.pdfBsdf = bsdf.pdf(frame, wo);
+    path.throughput = path.throughput
+        * bsdf.eval(frame, wo)
+        * cosTheta
+        / survive
+        / path.pdfBsdf;
+    path.direction = wo;
+    return true;
+}
+
+void Wavefront::TraceShadowRays(const Scene& scene)
+{
+    for (const ShadowRay& shadowRay : shadowRays) {
+        if (!scene.intersectP(Ray(shadowRay.origin, shadowRay.direction), shadowRay.distance)) {
+            paths[shadowRay.pathIx].L += shadowRay.radiance;
+        }
+    }
+}
+
+void Wavefront::Extend(const Scene& scene)
+{
+    active.clear();
+    for (int pathIx : extended) {
+        Path& path = paths[pathIx];
+        Intersection next = scene.intersect(Ray(path.coords, path.direction));
+        if (!next.happened) continue;
+
+        if (next.m->hasEmission()) {
+            // the bounce found a light: its share under MIS, then the path ends
+            path.L += path.throughput * next.m->getEmission() * scene.bsdfLightWeight(path.direction, path.pdfBsdf, next);
+            continue;
+        }
+        path.SetVertex(next);
+        ++path.depth;
+        active.push_back(pathIx);
+    }
+}
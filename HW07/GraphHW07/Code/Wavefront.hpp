@@ -0,0 +1,74 @@
+//
+// Wavefront path tracing: a batch of paths advances one bounce at a time and every
+// stage (intersect, sort by material, shade, trace shadow rays) runs over the whole
+// batch, instead of castPath following one path to its end before starting the next.
+//
+
+#pragma once
+
+#include "Sampler.hpp"
+#include "Scene.hpp"
+#include <vector>
+
+struct Tile;
+struct PixelStats;
+
+class Wavefront
+{
+public:
+    // Renderer::RenderTile for several tiles: samples paths per pixel, each path's radiance
+    // scaled by weight and added to target, skipping converged pixels of stats. the samples are
+    // split over batches of about maxPaths paths. the estimator is castPath's, every path draws
+    // from its own random stream
+    void Render(const Scene& scene, float scale, float imageAspectRatio, const Tile* tiles, int tileCount,
+                int samples, int maxPaths, uint64_t passSeed, Vector3f* target, float weight,
+                PixelStats* stats = nullptr);
+
+private:
+    // what castPath keeps in locals, about 100 bytes so a batch stays in cache
+    struct Path
+    {
+        Vector3f coords, normal; // vertex to shade next
+        Material* m = nullptr;
+        Vector3f direction;      // the path arrived along it, after shading the continuation
+        Vector3f throughput;
+        Vector3f L;
+        float pdfBsdf = 0;       // of the continuation, for MIS when it reaches a light
+        uint32_t pixelIx = 0;
+        int depth = 0;
+        PCG32 rng;
+
+        void SetVertex(const Intersection& hit)
+        {
+            coords = hit.coords;
+            normal = hit.normal;
+            m = hit.m;
+        }
+    };
+
+    // a light sample waiting for its occlusion test
+    struct ShadowRay
+    {
+        Vector3f origin, direction;
+        Vector3f radiance;      // added to the path when unblocked
+        float distance;
+        int pathIx;
+    };
+
+    // paths for samples [firstSample, endSample) of every pixel in tile
+    void Generate(const Scene& scene, float scale, float imageAspectRatio, const Tile& tile, int samples,
+                  int firstSample, int endSample, uint64_t passSeed, const PixelStats* stats);
+    void Shade(const Scene& scene);
+    // one castPath iteration up to the continuation ray, false when the path ends here
+    bool ShadePath(const Scene& scene, int pathIx);
+    void TraceShadowRays(const Scene& scene);
+    void Extend(const Scene& scene);
+
+    // kept between batches, so a worker allocates them once
+    std::vector<Path> paths;
+    std::vector<int> active;    // paths waiting to be shaded
+    std::vector<int> sorted;    // active grouped by material
+    std::vector<int> materialKeys;
+    std::vector<int> extended;  // paths with a continuation ray to trace
+    std::vector<ShadowRay> shadowRays;
+};
@@ -2,14 +2,11 @@
 #include <iostream>
 #include <cmath>
 #include <random>
+#include "Sampler.hpp"
 
 #undef M_PI
 #define M_PI 3.141592653589793f
 
-inline std::random_device dev;
-inline std::mt19937 rng(dev());
-inline std::uniform_real_distribution<float> dist(0.f, 1.f); // distribution in range [1, 6]
-
 extern const float  EPSILON;
 const float kInfinity = std::numeric_limits<float>::max();
 
@@ -36,9 +33,10 @@ inline bool solveQuadratic(const float &a, const float &b, const float &c, float
     return true;
 }
 
+// draws from the calling thread's own stream, see Sampler.hpp
 inline float get_random_float()
 {
-    return dist(rng);
+    return ThreadRng().NextFloat();
 }
 
 inline void UpdateProgress(float progress)
@@ -66,6 +66,8 @@ int main(int argc, char** argv)
     scene.buildBVH();
 
     Renderer r;
+    //r.engine = Renderer::Engine::WAVEFRONT;
+    //r.tracePath = "trace.json";
 
     auto start = std::chrono::system_clock::now();
     //r.RenderMultipleThread(scene);